@@ -1,10 +1,10 @@
-#ifdef CONFIG_64BIT
-#define BITS_PER_LONG 64
-#else
-#define BITS_PER_LONG 32
-#endif /* CONFIG_64BIT */
+#ifndef BITOPS_H
+#define BITOPS_H
 
 #define BITS_PER_BYTE           8
+/* Bits of the host long, the word the bitmaps below are made of */
+#define BITS_PER_LONG           (BITS_PER_BYTE * sizeof(long))
+#define BITS_PER_INT            (BITS_PER_BYTE * sizeof(int))
 #define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
 
 #define BIT(nr)                 (1U << (nr))
@@ -14,7 +14,9 @@
 #define BIT_ULL_MASK(nr)        (1ULL << ((nr) % BITS_PER_LONG_LONG))
 #define BIT_ULL_WORD(nr)        ((nr) / BITS_PER_LONG_LONG)
 
-#define BITS_TO_LONGS(nr)       DIV_ROUND_UP(nr, BITS_PER_BYTE * sizeof(long))
+/* Bitmaps are arrays of words holding BITS_PER_LONG bits each, so that
+ * BIT_WORD/BIT_MASK index them consistently on every host */
+#define BITS_TO_LONGS(nr)       DIV_ROUND_UP(nr, BITS_PER_LONG)
 
 #define BIT_ULL_MASK(nr)        (1ULL << ((nr) % BITS_PER_LONG_LONG))
 #define BIT_ULL_WORD(nr)        ((nr) / BITS_PER_LONG_LONG)
@@ -25,7 +27,7 @@
  * GENMASK_ULL(39, 21) gives us the 64bit vector 0x000000ffffe00000.
  */
 #define GENMASK(h, l) \
-	(((~0U) << (l)) & (~0U >> (BITS_PER_LONG  - (h) - 1)))
+	(((~0U) << (l)) & (~0U >> (BITS_PER_INT - (h) - 1)))
 
 #define NBITS2(n) ((n&2)?1:0)
 #define NBITS4(n) ((n&(0xC))?(2+NBITS2(n>>2)):(NBITS2(n)))
@@ -35,3 +37,80 @@
 #define NBITS(n) (n==0?0:NBITS32(n))
 
 #define EXTRACT_NBITS(nr, h, l) ((nr&GENMASK(h,l)) >> l)
+
+/*
+ * Bitmap helpers. set_bit/clear_bit are atomic, the __ variants are not
+ * and need the caller to protect the bitmap. The find_* routines read
+ * each word once and return @size when no matching bit exists.
+ */
+static inline void set_bit(int nr, unsigned long *addr)
+{
+	__atomic_fetch_or(&addr[BIT_WORD(nr)], BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline void clear_bit(int nr, unsigned long *addr)
+{
+	__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr), __ATOMIC_SEQ_CST);
+}
+
+static inline int test_and_clear_bit(int nr, unsigned long *addr)
+{
+	return (__atomic_fetch_and(&addr[BIT_WORD(nr)], ~BIT_MASK(nr),
+		__ATOMIC_SEQ_CST) & BIT_MASK(nr)) != 0;
+}
+
+static inline void __set_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] |= BIT_MASK(nr);
+}
+
+static inline void __clear_bit(int nr, unsigned long *addr)
+{
+	addr[BIT_WORD(nr)] &= ~BIT_MASK(nr);
+}
+
+static inline int test_bit(int nr, const unsigned long *addr)
+{
+	return (__atomic_load_n(&addr[BIT_WORD(nr)], __ATOMIC_RELAXED)
+		& BIT_MASK(nr)) != 0;
+}
+
+static inline int find_next_bit(const unsigned long *addr, int size, int offset)
+{
+	int w;
+	unsigned long word;
+
+	if (offset >= size)
+		return size;
+	w = BIT_WORD(offset);
+	word = __atomic_load_n(&addr[w], __ATOMIC_RELAXED)
+		& (~0UL << (offset % BITS_PER_LONG));
+	for (;;) {
+		if (word)
+			return w * BITS_PER_LONG + __builtin_ctzl(word);
+		if (++w >= BITS_TO_LONGS(size))
+			return size;
+		word = __atomic_load_n(&addr[w], __ATOMIC_RELAXED);
+	}
+}
+
+static inline int find_first_bit(const unsigned long *addr, int size)
+{
+	return find_next_bit(addr, size, 0);
+}
+
+/* First bit set in @addr1 but clear in @addr2 */
+static inline int find_first_andnot_bit(const unsigned long *addr1,
+		const unsigned long *addr2, int size)
+{
+	int w;
+	for (w = 0; w < BITS_TO_LONGS(size); w++) {
+		unsigned long word = __atomic_load_n(&addr1[w], __ATOMIC_RELAXED)
+			& ~__atomic_load_n(&addr2[w], __ATOMIC_RELAXED);
+		if (word)
+			return w * BITS_PER_LONG + __builtin_ctzl(word);
+	}
+	return size;
+}
+
+#endif /* BITOPS_H */
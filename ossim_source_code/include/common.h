@@ -42,8 +42,18 @@ struct inst_t {
 	uint32_t arg_2;
 };
 
+/* Pre-decoded instruction: address of its handler in the CPU
+ * interpreter and its operands, ready to execute */
+struct dinst_t {
+	const void * handler;
+	uint32_t arg_0;
+	uint32_t arg_1;
+	uint32_t arg_2;
+};
+
 struct code_seg_t {
 	struct inst_t * text;
+	struct dinst_t * decoded;	// text decoded by decode(), size + 1 records
 	uint32_t size;
 };
 
@@ -78,11 +88,41 @@ struct pcb_t {
 	// and this vale overwrites the default priority when it existed
 	uint32_t prio;     
 #endif
+	/* Intrusive run queue links, owned by the scheduler */
+	struct pcb_t * rq_prev;
+	struct pcb_t * rq_next;
+	struct pcb_list_t * rq_list;	// List the process waits on, NULL if none
+	struct pcb_t * rq_left;
+	struct pcb_t * rq_right;
+	int rq_height;
+	struct pcb_tree_t * rq_tree;	// Tree the process waits on, NULL if none
+	int rq_cpu;	// CPU whose run queue holds the process, -1 if none
+	int rq_index;	// Position in the EDF heap, -1 if none
+	/* Fair scheduling accounting */
+	uint64_t vruntime;	// Weighted virtual run time
+	uint64_t exec_start;	// Time slot of the last dispatch
+	/* Cache affinity */
+	int last_cpu;	// CPU that ran the process last, -1 if none yet
+	uint32_t migrations;	// Dispatches on a CPU other than last_cpu
+	/* Latency accounting */
+	uint64_t arrival;	// Time slot the process was added at
+	uint64_t response;	// Slots from arrival to its first dispatch
+	uint64_t cpu_time;	// Slots spent running
+	uint32_t preemptions;	// Time slots cut short by a more urgent arrival
+	/* Feedback scheduling */
+	uint32_t base_prio;	// Level given at load, restored by a boost
+	uint32_t mlfq_epoch;	// Last boost the process has seen
+	/* Real-time class */
+	uint64_t deadline;	// Relative deadline when loaded, absolute once added, 0 if none
+	uint32_t wcet;	// Worst-case execution time in slots, 0 for the code size
+	int rt;	// 1 if admitted to the EDF class, -1 if refused
 #ifdef MM_PAGING
 	struct mm_struct *mm;
 	struct memphy_struct *mram;
 	struct memphy_struct **mswp;
 	struct memphy_struct *active_mswp;
+	int swap_pgn;	// Page waited for while blocked on swap-in, -1 if none, -2 if it failed
+	uint64_t swap_ready;	// Time slot the swap daemon completes the transfer at
 #ifdef MM_PAGING_HEAP_GODOWN
 	uint32_t vmemsz;
 #endif
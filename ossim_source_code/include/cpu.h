@@ -9,5 +9,14 @@
  * Otherwise, return 1. */
 int run(struct pcb_t * proc);
 
+/* Execute up to [budget] instructions of a process in a row on CPU
+ * [cpu], one per time slot they stand for. A run of CALC is retired at
+ * once; a memory instruction is only executed as the first one of a
+ * call, and ends it. Return the number of instructions executed */
+uint32_t run_n(struct pcb_t * proc, int cpu, uint32_t budget);
+
+/* Translate [code]->text into [code]->decoded once, at load time */
+void decode(struct code_seg_t * code);
+
 #endif
 
@@ -14,10 +14,35 @@
 #define PAGING_MAX_PGN  (DIV_ROUND_UP(BIT(PAGING_CPU_BUS_WIDTH),PAGING_PAGESZ))
 
 #define PAGING_SBRK_INIT_SZ PAGING_PAGESZ
+/* vma0 (DATA, ALLOC) grows up from 0, vma1 (HEAP, MALLOC) grows up from
+ * the middle of the address space */
+#define PAGING_HEAP_START BIT(PAGING_CPU_BUS_WIDTH - 1)
+
+/* Two-level page table: a directory of leaf tables of PTEs,
+ * leaves are only allocated once a page in their range is mapped */
+#define PAGING_PTE_LEAF_BITS 8
+#define PAGING_PTRS_PER_LEAF BIT(PAGING_PTE_LEAF_BITS)
+#define PAGING_PGD_ENTRIES (DIV_ROUND_UP(PAGING_MAX_PGN,PAGING_PTRS_PER_LEAF))
+#define PAGING_PGD_IDX(pgn) ((pgn) >> PAGING_PTE_LEAF_BITS)
+#define PAGING_LEAF_IDX(pgn) ((pgn) & (PAGING_PTRS_PER_LEAF - 1))
+
+/* Huge page: PAGING_HUGE_NR base pages at an aligned PGN, mapped by
+ * the PTE of the first one over as many contiguous aligned frames */
+#define PAGING_HUGE_ORDER 4
+#define PAGING_HUGE_NR BIT(PAGING_HUGE_ORDER)
+#define PAGING_HUGE_IDX(pgn) ((pgn) & (PAGING_HUGE_NR - 1))
+
+/* pg_getpage: the page is being swapped in by the swap daemon, the
+ * access is retried once the process is woken up */
+#define PAGING_PG_INFLIGHT 1
+
+/* Per-CPU software TLB geometry, both powers of 2 */
+#define PAGING_TLB_SETS 16
+#define PAGING_TLB_WAYS 4
 /* PTE BIT */
 #define PAGING_PTE_PRESENT_MASK BIT(31) 
 #define PAGING_PTE_SWAPPED_MASK BIT(30)
-#define PAGING_PTE_RESERVE_MASK BIT(29)
+#define PAGING_PTE_HUGE_MASK BIT(29) /* the former reserved bit */
 #define PAGING_PTE_DIRTY_MASK BIT(28)
 #define PAGING_PTE_EMPTY01_MASK BIT(14)
 #define PAGING_PTE_EMPTY02_MASK BIT(13)
@@ -26,6 +51,11 @@
 #define PAGING_PTE_SET_PRESENT(pte) (pte=pte|PAGING_PTE_PRESENT_MASK)
 #define PAGING_PTE_PAGE_PRESENT(pte) (pte&PAGING_PTE_PRESENT_MASK)
 
+/* PTE BIT HUGE */
+#define PAGING_PTE_PAGE_HUGE(pte) (((pte) & (PAGING_PTE_PRESENT_MASK | \
+        PAGING_PTE_SWAPPED_MASK | PAGING_PTE_HUGE_MASK)) == \
+        (PAGING_PTE_PRESENT_MASK | PAGING_PTE_HUGE_MASK))
+
 /* USRNUM */
 #define PAGING_PTE_USRNUM_LOBIT 15
 #define PAGING_PTE_USRNUM_HIBIT 27
@@ -92,11 +122,10 @@
 /* Extract SWAPTYPE */
 #define PAGING_FPN(x)  GETVAL(x,PAGING_FPN_MASK,PAGING_ADDR_FPN_LOBIT)
 
-/* Memory range operator */
-/* TODO implement the INCLUDE checking mechanism - currently dummy op only */
-#define INCLUDE(x1,x2,y1,y2) (0)
-/* TODO implement the OVERLAP checking mechanism - currently dummy op only */
-#define OVERLAP(x1,x2,y1,y2) (1)
+/* Memory range operator, on [x1,x2) and [y1,y2) */
+#define INCLUDE(x1,x2,y1,y2) ((x1) >= (y1) && (x2) <= (y2))
+/* An empty [y1,y1) still overlaps a range it lies strictly within */
+#define OVERLAP(x1,x2,y1,y2) ((x1) < (y2) && (y1) < (x2))
 
 /* VM region prototypes */
 struct vm_rg_struct * init_vm_rg(int rg_start, int rg_endi, int vmaid);
@@ -104,11 +133,16 @@ int enlist_vm_rg_node(struct vm_rg_struct **rglist, struct vm_rg_struct* rgnode)
 int enlist_pgn_node(struct pgn_t **pgnlist, int pgn);
 int vmap_page_range(struct pcb_t *caller, int addr, int pgnum, 
                     struct framephy_struct *frames, struct vm_rg_struct *ret_rg);
-int vm_map_ram(struct pcb_t *caller, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
-int alloc_pages_range(struct pcb_t *caller, int incpgnum, struct framephy_struct **frm_lst);
+int vm_map_ram(struct pcb_t *caller, int cpu, int astart, int send, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg);
+int alloc_pages_range(struct pcb_t *caller, int cpu, int incpgnum, struct framephy_struct **frm_lst);
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) ;
+uint32_t *pte_lookup(struct mm_struct *mm, int pgn);
+uint32_t *pte_alloc(struct mm_struct *mm, int pgn);
+int free_pgd(struct mm_struct *mm);
 int pte_set_fpn(uint32_t *pte, int fpn);
+int pte_set_huge(uint32_t *pte, int fpn);
+int pte_demote(struct mm_struct *mm, int pgn);
 int pte_set_swap(uint32_t *pte, int swptyp, int swpoff);
 int init_pte(uint32_t *pte,
              int pre,    // present
@@ -117,23 +151,27 @@ int init_pte(uint32_t *pte,
              int swp,    // swap
              int swptyp, // swap type
              int swpoff); //swap offset
-int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr);
+int __alloc(struct pcb_t *caller, int cpu, int vmaid, int rgid, int size, int *alloc_addr);
 int __free(struct pcb_t *caller, int rgid);
-int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data);
-int __write(struct pcb_t *caller, int rgid, int offset, BYTE value);
+int __read(struct pcb_t *caller, int cpu, int rgid, int offset, BYTE *data);
+int __write(struct pcb_t *caller, int cpu, int rgid, int offset, BYTE value);
 int init_mm(struct mm_struct *mm, struct pcb_t *caller);
 
-/* VM prototypes */
-int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
-int pgmalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index);
+/* VM prototypes, [cpu] is the CPU executing the instruction: its TLB
+ * and frame magazines are used */
+int pgalloc(struct pcb_t *proc, int cpu, uint32_t size, uint32_t reg_index);
+int pgmalloc(struct pcb_t *proc, int cpu, uint32_t size, uint32_t reg_index);
 int pgfree_data(struct pcb_t *proc, uint32_t reg_index);
+int free_pcb_memph(struct pcb_t *caller, int cpu);
 int pgread(
 		struct pcb_t * proc, // Process executing the instruction
+		int cpu, // CPU executing it
 		uint32_t source, // Index of source register
 		uint32_t offset, // Source address = [source] + [offset]
 		uint32_t destination);
 int pgwrite(
 		struct pcb_t * proc, // Process executing the instruction
+		int cpu, // CPU executing it
 		BYTE data, // Data to be wrttien into memory
 		uint32_t destination, // Index of destination register
 		uint32_t offset);
@@ -141,17 +179,43 @@ int pgwrite(
 struct vm_rg_struct * get_symrg_byid(struct mm_struct* mm, int rgid);
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend);
 int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_struct *newrg);
-int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int* inc_limit_ret);
+int inc_vma_limit(struct pcb_t *caller, int cpu, int vmaid, int inc_sz, int* inc_limit_ret);
 int find_victim_page(struct mm_struct* mm, int *pgn);
+int swap_out_page(struct mm_struct *mm, struct pcb_t *caller, int cpu, int *fpn);
+int swap_in_page(struct mm_struct *mm, int pgn, struct pcb_t *caller, int cpu);
 struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid);
 
 /* MEM/PHY protypes */
-int MEMPHY_get_freefp(struct memphy_struct *mp, int *fpn);
-int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn);
+int MEMPHY_get_freefp(struct memphy_struct *mp, int cpu, int *fpn);
+int MEMPHY_alloc_order(struct memphy_struct *mp, int order, int *fpn);
+int MEMPHY_free_order(struct memphy_struct *mp, int fpn, int order);
+int MEMPHY_put_freefp(struct memphy_struct *mp, int cpu, int fpn);
+int MEMPHY_drain_mags(struct memphy_struct *mp);
+int MEMPHY_init_mags(struct memphy_struct *mp, int ncpus);
 int MEMPHY_read(struct memphy_struct * mp, int addr, BYTE *value);
 int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data);
+int MEMPHY_read_frame(struct memphy_struct *mp, int fpn, BYTE *buf);
+int MEMPHY_write_frame(struct memphy_struct *mp, int fpn, const BYTE *buf);
 int MEMPHY_dump(struct memphy_struct * mp);
+int MEMPHY_frag_dump(struct memphy_struct *mp);
 int init_memphy(struct memphy_struct *mp, int max_size, int randomflg);
+
+/* TLB prototypes */
+int init_tlb(int ncpus);
+int tlb_lookup(int cpu, struct mm_struct *mm, int pgn, int *fpn);
+int tlb_fill(int cpu, struct mm_struct *mm, int pgn, int fpn);
+int tlb_flush_page(struct mm_struct *mm, int pgn);
+int tlb_flush_range(struct mm_struct *mm, int pgn, int nr);
+int tlb_flush_mm(struct mm_struct *mm);
+int tlb_dump(void);
+/* Swap daemon prototypes */
+struct timer_id_t;
+int init_swapd(struct timer_id_t *timer_id, int latency);
+int swapd_active(void);
+void *swapd_routine(void *arg);
+int swapd_submit(struct pcb_t *proc);
+int swapd_stop(void);
+
 /* DEBUG */
 int print_list_fp(struct framephy_struct *fp);
 int print_list_rg(struct vm_rg_struct *rg);
@@ -1,15 +1,41 @@
 #ifndef OSCFG_H
 #define OSCFG_H
 
+/* Per-CPU multi-level queue scheduler. Without it every CPU shares a
+ * single ready queue ('make os-fifo' builds that variant) */
+#ifndef SCHED_SINGLE_QUEUE
 #define MLQ_SCHED 1
+#endif
 #define MAX_PRIO 140
+/* MLQ levels a process waiting on a sibling CPU must beat the local
+ * best by before a busy CPU pulls it away from its warm cache */
+#define AFFINITY_PRIO_TOLERANCE 10
+/* A process added with a more urgent MLQ level than some running one
+ * preempts it instead of waiting for the end of its time slot */
+#define SCHED_PREEMPT 1
+/* Slots between two MLFQ boosts, which put every process back to the
+ * level it was loaded with so demoted ones cannot starve */
+#define MLFQ_BOOST_PERIOD 50
 
 #define MM_PAGING
+/* Map aligned runs of PAGING_HUGE_NR pages with a single huge PTE
+ * when MEMRAM has that many contiguous free frames */
+#define MM_HUGEPAGE 1
+/* Slots a swapped page takes to come back to MEMRAM, during which
+ * the faulting process is blocked and its CPU runs others */
+#define PAGING_SWAP_LATENCY 2
+/* Make MEMSWP sequential devices: a seek costs MEMPHY_SEEK_COST slots
+ * for every MEMPHY_SEEK_SPAN bytes (or part) the cursor travels.
+ * Also set at run time by the --seq-swap option */
+//#define MM_SWP_SEQUENTIAL 1
+#define MEMPHY_SEEK_COST 1
+#define MEMPHY_SEEK_SPAN 0x100000
 //#define MM_PAGING_HEAP_GODOWN
 //#define MM_FIXED_MEMSZ
 //#define VMDBG 1
 //#define MMDBG 1
 #define IODUMP 1
 #define PAGETBL_DUMP 1
+#define TIMER_SKIP_IDLE 1
 
 #endif
@@ -4,6 +4,7 @@
 #define MM_PAGING
 #define PAGING_MAX_MMSWP 4 /* max number of supported swapped space */
 #define PAGING_MAX_SYMTBL_SZ 30
+#define MEMPHY_MAX_ORDER 10 /* largest buddy block is 2^10 frames */
 
 typedef char BYTE;
 typedef uint32_t addr_t;
@@ -48,7 +49,8 @@ struct vm_area_struct {
  * Memory management struct
  */
 struct mm_struct {
-   uint32_t *pgd;
+   /* Page directory, NULL slots are leaf tables not allocated yet */
+   uint32_t **pgd;
 
    struct vm_area_struct *mmap;
 
@@ -64,12 +66,24 @@ struct mm_struct {
  */
 struct framephy_struct { 
    int fpn;
+   int fp_nr; /* contiguous frames from fpn, a buddy block of 2^k */
    struct framephy_struct *fp_next;
 
    /* Resereed for tracking allocated framed */
    struct mm_struct* owner;
 };
 
+/*
+ * Per-CPU cache of free frames. Only its own CPU takes or gives frames
+ * through it, lock-free; MEMPHY_drain_mags empties it under fp_lock
+ */
+#define MEMPHY_MAG_SIZE 16
+#define MEMPHY_MAG_BATCH 8 /* frames moved per trip to the shared pool */
+struct memphy_mag {
+   uint64_t top; /* generation << 32 | frames cached, changed by CAS */
+   int fpn[MEMPHY_MAG_SIZE];
+};
+
 struct memphy_struct {
    /* Basic field of data and size */
    BYTE *storage;
@@ -78,9 +92,18 @@ struct memphy_struct {
    /* Sequential device fields */ 
    int rdmflg;
    int cursor;
-
-   /* Management structure */
-   struct framephy_struct *free_fp_list;
+   int csr_lock;
+   unsigned long seek_slots; /* slots charged for seeks so far */
+
+   /* Management structure: buddy free lists, one bitmap of free
+    * blocks per order (see mm-memphy.c) */
+   unsigned long *free_area[MEMPHY_MAX_ORDER + 1];
+   int nr_free[MEMPHY_MAX_ORDER + 1];
+   int fp_hint[MEMPHY_MAX_ORDER + 1]; /* next-fit start of the search, per order */
+   int numfp;
+   int fp_lock;
+   struct memphy_mag *mag; /* one per CPU, see MEMPHY_init_mags */
+   int nr_mag;
    struct framephy_struct *used_fp_list;
 };
 
@@ -1,14 +1,44 @@
-
 #ifndef QUEUE_H
 #define QUEUE_H
 
 #include "common.h"
+#include <stdatomic.h>
+
+/*
+ * Lock-free multi-producer/multi-consumer FIFO of processes.
+ *
+ * A queue is a chain of bounded ring segments (Vyukov style: every cell
+ * carries a sequence number telling producers and consumers whose turn
+ * it is). Producers and consumers only claim positions with CAS, so
+ * no lock is needed. A segment found full is closed and a new one is
+ * linked after it, so the queue grows instead of dropping processes.
+ * Segments consumers are done with are retired, then reused by the
+ * next segment needed once no operation that may still see them is in
+ * flight. A zero-filled queue_t is a valid empty queue.
+ */
+#define QUEUE_SEG_SIZE 16	/* Cells per segment, power of two */
 
-#define MAX_QUEUE_SIZE 10
+struct queue_cell_t {
+	atomic_ulong seq;
+	struct pcb_t * proc;
+};
+
+struct queue_seg_t {
+	struct queue_cell_t cell[QUEUE_SEG_SIZE];
+	atomic_ulong head;	// Next position to consume
+	atomic_ulong tail;	// Next position to produce, top bit = closed
+	struct queue_seg_t * _Atomic next;
+	struct queue_seg_t * all_next;	// Every segment of the queue, for free_queue
+	struct queue_seg_t * free_next;	// On the retired or spare stack
+};
 
 struct queue_t {
-	struct pcb_t * proc[MAX_QUEUE_SIZE];
-	int size;
+	struct queue_seg_t * _Atomic head;
+	struct queue_seg_t * _Atomic tail;
+	struct queue_seg_t * _Atomic segs;
+	struct queue_seg_t * _Atomic retired;	// Drained, maybe still seen
+	struct queue_seg_t * _Atomic spare;	// Drained, ready for reuse
+	atomic_int users;	// Operations in flight
 };
 
 void enqueue(struct queue_t * q, struct pcb_t * proc);
@@ -17,5 +47,67 @@ struct pcb_t * dequeue(struct queue_t * q);
 
 int empty(struct queue_t * q);
 
+/* Release the segments of a queue nobody uses anymore */
+void free_queue(struct queue_t * q);
+
+/*
+ * Intrusive FIFO of processes linked through pcb_t.rq_prev/rq_next.
+ * Push, pop and unlink of any member are O(1) and never allocate.
+ * Not thread-safe: the owner of the list provides the locking.
+ */
+struct pcb_list_t {
+	struct pcb_t * head;
+	struct pcb_t * tail;
+	int size;
+};
+
+void list_enqueue(struct pcb_list_t * l, struct pcb_t * proc);
+
+struct pcb_t * list_dequeue(struct pcb_list_t * l);
+
+/* Remove [proc] from the list it is linked on (proc->rq_list) */
+void list_unlink(struct pcb_t * proc);
+
+int list_empty(struct pcb_list_t * l);
+
+/*
+ * Intrusive AVL tree of processes ordered by (vruntime, pid), linked
+ * through pcb_t.rq_left/rq_right. Insert, remove and leftmost lookup
+ * are O(log n) and never allocate. Not thread-safe either.
+ */
+struct pcb_tree_t {
+	struct pcb_t * root;
+	int size;
+};
+
+void tree_insert(struct pcb_tree_t * t, struct pcb_t * proc);
+
+/* Remove [proc] from the tree it is linked on (proc->rq_tree) */
+void tree_remove(struct pcb_t * proc);
+
+/* Process with the smallest key, NULL if the tree is empty */
+struct pcb_t * tree_first(struct pcb_tree_t * t);
+
+/*
+ * Binary min-heap of processes ordered by (deadline, pid). Each member
+ * keeps its position in pcb_t.rq_index so it can be removed in
+ * O(log n). The array grows on demand. Not thread-safe either.
+ */
+struct pcb_heap_t {
+	struct pcb_t ** proc;
+	int size;
+	int cap;
+};
+
+void heap_push(struct pcb_heap_t * h, struct pcb_t * proc);
+
+/* Take the process with the earliest deadline, NULL if none */
+struct pcb_t * heap_pop(struct pcb_heap_t * h);
+
+/* Remove [proc], which must be a member of [h] */
+void heap_remove(struct pcb_heap_t * h, struct pcb_t * proc);
+
+void heap_free(struct pcb_heap_t * h);
+
 #endif
 
@@ -1,28 +1,91 @@
-#ifndef QUEUE_H
-#define QUEUE_H
+#ifndef SCHED_H
+#define SCHED_H
 
 #include "common.h"
 
-#ifndef MLQ_SCHED
-#define MLQ_SCHED
-#endif
+struct timer_id_t;
 
 //#define MAX_PRIO 139
 
+/* Policy ordering the ready processes of each CPU */
+enum sched_policy_t {
+	SCHED_POLICY_MLQ,	// Multi-level queue, slots per level (default)
+	SCHED_POLICY_CFS,	// Completely fair, weighted virtual run time
+	SCHED_POLICY_MLFQ	// MLQ with per-band quanta, demotion and boost
+};
+
+/* Most MLFQ bands (quanta) a config file may give */
+#define MLFQ_MAX_BANDS 8
+
 int queue_empty(void);
 
-void init_scheduler(void);
-void finish_scheduler(void);
+/* Map a policy name of the config file ("mlq", "cfs", "mlfq") to its
+ * value, -1 if unknown */
+int sched_policy_by_name(const char * name);
+
+void init_scheduler(int num_cpus, int policy);
+
+/* Split the levels 0 .. MAX_PRIO-1 evenly into [nr_bands] MLFQ bands,
+ * band i giving [quanta[i]] slots per dispatch */
+void init_mlfq(int nr_bands, const int * quanta);
 
-/* Get the next process from ready queue */
-struct pcb_t * get_proc(void);
+/* Slots [proc] may run per dispatch: its band's quantum under MLFQ,
+ * [time_slot] otherwise */
+int get_quantum(struct pcb_t * proc, int time_slot);
 
-/* Put a process back to run queue */
-void put_proc(struct pcb_t * proc);
+/* Print the per-process and per-CPU report, also written as CSV to
+ * [csv] unless it is NULL, and release the scheduler */
+void finish_scheduler(const char * csv);
+
+/* Get the next process from the ready queue of CPU [cpu], stealing
+ * from a sibling CPU when the local queue is empty */
+struct pcb_t * get_proc(int cpu);
+
+/* Put a process back to the run queue of CPU [cpu] */
+void put_proc(struct pcb_t * proc, int cpu);
 
 /* Add a new process to ready queue */
 void add_proc(struct pcb_t * proc);
 
+/* CPU [cpu] is driven by the timer device [timer_id] */
+void attach_cpu(int cpu, struct timer_id_t * timer_id);
+
+/* Take idle CPU [cpu] off the timer until a process is added for it or
+ * arrivals end. Return 0 if it must take an idle slot instead */
+int park_cpu(int cpu);
+
+/* A more urgent process has been added for CPU [cpu]: its running
+ * process should go back to the run queue before it runs again */
+int need_resched(int cpu);
+
+/* [proc] leaves its CPU with [slots_left] slots of its quantum unused,
+ * which the more urgent process does not have to wait for */
+void preempt_proc(struct pcb_t * proc, int slots_left);
+
+/* The loader has added its last process: release the parked CPUs */
+void end_of_arrivals(void);
+
+/* Take the running [proc] off its CPU until wake_proc(), e.g. while
+ * one of its pages is swapped in */
+void block_proc(struct pcb_t * proc);
+
+/* Give a blocked process back to the run queue of the CPU it last ran
+ * on, waking an idle CPU for it */
+void wake_proc(struct pcb_t * proc);
+
+/* Number of blocked processes: CPUs must not stop while some remain */
+int procs_blocked(void);
+
+#ifdef MLQ_SCHED
+/* Change the priority of [proc]. A waiting process moves to its new
+ * level in O(1) whatever the length of the queues */
+void set_proc_prio(struct pcb_t * proc, uint32_t prio);
+#endif
+
+/* Record the accounting of a process that has finished, before its
+ * PCB is freed */
+void finish_proc(struct pcb_t * proc);
+
 #endif
 
 
@@ -4,13 +4,12 @@
 #include <pthread.h>
 #include <stdint.h>
 
+/* Wake-up time of a device that waits for something else to happen */
+#define TIMER_NEVER UINT64_MAX
+
 struct timer_id_t {
-	int done;
-	int fsh;
-	pthread_cond_t event_cond;
-	pthread_mutex_t event_lock;
-	pthread_cond_t timer_cond;
-	pthread_mutex_t timer_lock;
+	int fsh;	// Device has left the slot barrier
+	int sense;	// Local sense, flipped every time the device passes a slot
 };
 
 void start_timer();
@@ -23,6 +22,36 @@ void detach_event(struct timer_id_t * event);
 
 void next_slot(struct timer_id_t* timer_id);
 
+/* Same as next_slot but tell the timer that the device has nothing to
+ * do before time slot [until] (TIMER_NEVER if it only waits for others) */
+void idle_slot(struct timer_id_t* timer_id, uint64_t until);
+
 uint64_t current_time();
 
+/* The device is busy for the next [n] slots: it rejoins the barrier
+ * [n] slots later, the clock ticking without it meanwhile. A
+ * timer_unpark() cuts the sleep short. Return the slots that actually
+ * passed, from 0 (unparked beforehand) to [n] */
+uint64_t next_slots(struct timer_id_t * timer_id, uint64_t n);
+
+/* Leave the barrier and sleep until timer_unpark(); slots go on without
+ * the device meanwhile. Returns at once if the device was unparked
+ * before it got to park */
+void timer_park(struct timer_id_t * timer_id);
+
+/* Wake a parked device into the slot of the caller, which must be an
+ * attached device that has not finished its current slot yet. A device
+ * that is not parked has its next park or batch cut short, unless it
+ * parks or ends a batch first */
+void timer_unpark(struct timer_id_t * timer_id);
+
+/* Cooperative engine: run [routine] as a coroutine of the device
+ * [timer_id] instead of a thread. Every spawned device is stepped in
+ * spawn order, one slot at a time, by timer_coop_run() on the calling
+ * thread until all of them have detached */
+void timer_coop_spawn(struct timer_id_t * timer_id,
+		void * (*routine)(void *), void * arg);
+
+void timer_coop_run(void);
+
 #endif
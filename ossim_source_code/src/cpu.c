@@ -2,6 +2,7 @@
 #include "cpu.h"
 #include "mem.h"
 #include "mm.h"
+#include <stdlib.h>
 
 int calc(struct pcb_t * proc) {
 	return ((unsigned long)proc & 0UL);
@@ -45,58 +46,149 @@ int write(
 	return write_mem(proc->regs[destination] + offset, proc, data);
 } 
 
-int run(struct pcb_t * proc) {
-	/* Check if Program Counter point to the proper instruction */
-	if (proc->pc >= proc->code->size) {
-		return 1;
-	}
-	
-	struct inst_t ins = proc->code->text[proc->pc];
-	proc->pc++;
-	int stat = 1;
-	switch (ins.opcode) {
-	case CALC:
-		stat = calc(proc);
-		break;
-	case ALLOC:
+/*
+ *  Threaded-code interpreter. Every instruction is decoded once into
+ *  the address of its handler below plus its operands, and a handler
+ *  jumps straight to the handler of the next instruction (GCC computed
+ *  goto), so executing one does not go through a switch. A sentinel
+ *  record after the last instruction stops at the end of the code.
+ *  Execute up to [budget] instructions of [proc], stopping at the first
+ *  one that fails. With [batch] set, a memory instruction only runs as
+ *  the first one, and then alone. Return how many were executed, the
+ *  status of the last one in [stat]. Called with [proc] NULL, only
+ *  publish the handlers.
+ */
+#define OP_END	(WRITE + 1)	/* Handler of the sentinel record */
+
+static const void * const * op_handler;
+
+static uint32_t exec(struct pcb_t * proc, int cpu, uint32_t budget,
+		int batch, int * stat) {
+	static const void * const handler[] = {
+		[CALC] = &&do_calc,
+		[ALLOC] = &&do_alloc,
 #ifdef MM_PAGING
-		stat = pgalloc(proc, ins.arg_0, ins.arg_1);
+		[MALLOC] = &&do_malloc,
+#endif
+		[FREE] = &&do_free,
+		[READ] = &&do_read,
+		[WRITE] = &&do_write,
+		[OP_END] = &&do_end,
+	};
+	const struct dinst_t * start, * ip;
+
+	*stat = 1;
+	if (proc == NULL) {
+		op_handler = handler;
+		return 0;
+	}
+	if (proc->pc >= proc->code->size || budget == 0) {
+		return 0;
+	}
+	start = ip = &proc->code->decoded[proc->pc];
+	goto *ip->handler;
+
+#define NEXT() do {						\
+		ip++;						\
+		if (*stat != 0 || --budget == 0) {		\
+			goto out;				\
+		}						\
+		goto *ip->handler;				\
+	} while (0)
+/* A memory instruction can only open a batch, and closes it */
+#define MEMORY_OP() do {					\
+		if (batch && ip != start) {			\
+			goto out;				\
+		}						\
+		if (batch) {					\
+			budget = 1;				\
+		}						\
+	} while (0)
 
+do_calc:
+	*stat = calc(proc);
+	NEXT();
+do_alloc:
+	MEMORY_OP();
+#ifdef MM_PAGING
+	*stat = pgalloc(proc, cpu, ip->arg_0, ip->arg_1);
 #else
-		stat = alloc(proc, ins.arg_0, ins.arg_1);
+	*stat = alloc(proc, ip->arg_0, ip->arg_1);
 #endif
-		break;
+	NEXT();
 #ifdef MM_PAGING
-	case MALLOC:
-		stat = pgmalloc(proc, ins.arg_0, ins.arg_1);
-		break;
+do_malloc:
+	MEMORY_OP();
+	*stat = pgmalloc(proc, cpu, ip->arg_0, ip->arg_1);
+	NEXT();
 #endif
-	case FREE:
+do_free:
+	MEMORY_OP();
 #ifdef MM_PAGING
-		stat = pgfree_data(proc, ins.arg_0);
+	*stat = pgfree_data(proc, ip->arg_0);
 #else
-		stat = free_data(proc, ins.arg_0);
+	*stat = free_data(proc, ip->arg_0);
 #endif
-		break;
-	case READ:
+	NEXT();
+do_read:
+	MEMORY_OP();
 #ifdef MM_PAGING
-		stat = pgread(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+	*stat = pgread(proc, cpu, ip->arg_0, ip->arg_1, ip->arg_2);
+	if (*stat == PAGING_PG_INFLIGHT) {
+		/* Not done: the instruction runs again after the swap-in */
+		goto out;
+	}
 #else
-		stat = read(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+	*stat = read(proc, ip->arg_0, ip->arg_1, ip->arg_2);
 #endif
-		break;
-	case WRITE:
+	NEXT();
+do_write:
+	MEMORY_OP();
 #ifdef MM_PAGING
-		stat = pgwrite(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+	*stat = pgwrite(proc, cpu, ip->arg_0, ip->arg_1, ip->arg_2);
+	if (*stat == PAGING_PG_INFLIGHT) {
+		/* Not done: the instruction runs again after the swap-in */
+		goto out;
+	}
 #else
-		stat = write(proc, ins.arg_0, ins.arg_1, ins.arg_2);
+	*stat = write(proc, ip->arg_0, ip->arg_1, ip->arg_2);
 #endif
-		break;
-	default:
-		stat = 1;
-	}
-	return stat;
+	NEXT();
+#undef NEXT
+#undef MEMORY_OP
+do_end:
+	*stat = 1;
+out:
+	proc->pc = ip - proc->code->decoded;
+	return ip - start;
+}
+
+void decode(struct code_seg_t * code) {
+	uint32_t i;
 
+	if (op_handler == NULL) {
+		int stat;
+		exec(NULL, -1, 0, 0, &stat);
+	}
+	code->decoded = (struct dinst_t *)malloc(
+		sizeof(struct dinst_t) * (code->size + 1));
+	for (i = 0; i < code->size; i++) {
+		struct inst_t * ins = &code->text[i];
+		code->decoded[i].handler = op_handler[ins->opcode];
+		code->decoded[i].arg_0 = ins->arg_0;
+		code->decoded[i].arg_1 = ins->arg_1;
+		code->decoded[i].arg_2 = ins->arg_2;
+	}
+	code->decoded[code->size].handler = op_handler[OP_END];
 }
 
+int run(struct pcb_t * proc) {
+	int stat;
+	exec(proc, -1, 1, 0, &stat);
+	return stat;
+}
 
+uint32_t run_n(struct pcb_t * proc, int cpu, uint32_t budget) {
+	int stat;
+	return exec(proc, cpu, budget, 1, &stat);
+}
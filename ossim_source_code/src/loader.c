@@ -1,5 +1,6 @@
 
 #include "loader.h"
+#include "cpu.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -45,6 +46,29 @@ struct pcb_t * load(const char * path) {
 		(struct page_table_t*)malloc(sizeof(struct page_table_t));
 	proc->bp = PAGE_SIZE;
 	proc->pc = 0;
+	proc->rq_prev = proc->rq_next = NULL;
+	proc->rq_list = NULL;
+	proc->rq_left = proc->rq_right = NULL;
+	proc->rq_tree = NULL;
+	proc->rq_cpu = -1;
+	proc->rq_index = -1;
+	proc->vruntime = 0;
+	proc->exec_start = 0;
+	proc->last_cpu = -1;
+	proc->migrations = 0;
+	proc->arrival = 0;
+	proc->response = 0;
+	proc->cpu_time = 0;
+	proc->preemptions = 0;
+	proc->base_prio = 0;
+	proc->mlfq_epoch = 0;
+	proc->deadline = 0;
+	proc->wcet = 0;
+	proc->rt = 0;
+#ifdef MM_PAGING
+	proc->swap_pgn = -1;
+	proc->swap_ready = 0;
+#endif
 
 	/* Read process code from file */
 	FILE * file;
@@ -100,6 +124,7 @@ struct pcb_t * load(const char * path) {
 			exit(1);
 		}
 	}
+	decode(proc->code);
 	return proc;
 }
 
@@ -6,22 +6,40 @@
 
 #include "mm.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Short critical sections only, a spinning CPU never waits long */
+static inline void memphy_lock(int *lock)
+{
+   while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+     ;
+}
+
+static inline void memphy_unlock(int *lock)
+{
+   __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 /*
  *  MEMPHY_mv_csr - move MEMPHY cursor
  *  @mp: memphy struct
  *  @offset: offset
+ *
+ *  The cursor goes straight to [offset] and the device is charged for
+ *  the distance it travelled, see MEMPHY_SEEK_COST. Called with
+ *  csr_lock held.
  */
 int MEMPHY_mv_csr(struct memphy_struct *mp, int offset)
 {
-   int numstep = 0;
+   int dist;
 
-   mp->cursor = 0;
-   while(numstep < offset && numstep < mp->maxsz){
-     /* Traverse sequentially */
-     mp->cursor = (mp->cursor + 1) % mp->maxsz;
-     numstep++;
-   }
+   if (offset < 0 || offset >= mp->maxsz)
+     return -1;
+
+   dist = abs(offset - mp->cursor);
+   mp->cursor = offset;
+   mp->seek_slots += DIV_ROUND_UP(dist, MEMPHY_SEEK_SPAN) * MEMPHY_SEEK_COST;
 
    return 0;
 }
@@ -37,11 +55,17 @@ int MEMPHY_seq_read(struct memphy_struct *mp, int addr, BYTE *value)
    if (mp == NULL)
      return -1;
 
-   if (!mp->rdmflg)
+   if (mp->rdmflg)
      return -1; /* Not compatible mode for sequential read */
 
-   MEMPHY_mv_csr(mp, addr);
+   memphy_lock(&mp->csr_lock); /* The cursor is shared device state */
+   if (MEMPHY_mv_csr(mp, addr) != 0)
+   {
+     memphy_unlock(&mp->csr_lock);
+     return -1;
+   }
    *value = (BYTE) mp->storage[addr];
+   memphy_unlock(&mp->csr_lock);
 
    return 0;
 }
@@ -77,11 +101,17 @@ int MEMPHY_seq_write(struct memphy_struct * mp, int addr, BYTE value)
    if (mp == NULL)
      return -1;
 
-   if (!mp->rdmflg)
-     return -1; /* Not compatible mode for sequential read */
+   if (mp->rdmflg)
+     return -1; /* Not compatible mode for sequential write */
 
-   MEMPHY_mv_csr(mp, addr);
+   memphy_lock(&mp->csr_lock); /* The cursor is shared device state */
+   if (MEMPHY_mv_csr(mp, addr) != 0)
+   {
+     memphy_unlock(&mp->csr_lock);
+     return -1;
+   }
    mp->storage[addr] = value;
+   memphy_unlock(&mp->csr_lock);
 
    return 0;
 }
@@ -105,56 +135,385 @@ int MEMPHY_write(struct memphy_struct * mp, int addr, BYTE data)
    return 0;
 }
 
+/*
+ *  MEMPHY_read_frame - read a whole frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  @buf: PAGING_PAGESZ bytes to fill
+ *
+ *  One memcpy on a random-access device. A sequential device seeks
+ *  once, then the frame streams past the cursor.
+ */
+int MEMPHY_read_frame(struct memphy_struct *mp, int fpn, BYTE *buf)
+{
+   int addr, i;
+
+   if (mp == NULL || fpn < 0 || fpn >= mp->numfp)
+     return -1;
+
+   addr = fpn * PAGING_PAGESZ;
+   if (mp->rdmflg)
+   {
+     memcpy(buf, mp->storage + addr, PAGING_PAGESZ);
+     return 0;
+   }
+
+   memphy_lock(&mp->csr_lock);
+   MEMPHY_mv_csr(mp, addr);
+   for (i = 0; i < PAGING_PAGESZ; i++)
+   {
+     buf[i] = mp->storage[mp->cursor];
+     mp->cursor = (mp->cursor + 1) % mp->maxsz;
+   }
+   memphy_unlock(&mp->csr_lock);
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_write_frame - write a whole frame
+ *  @mp: memphy struct
+ *  @fpn: frame number
+ *  @buf: PAGING_PAGESZ bytes to store
+ */
+int MEMPHY_write_frame(struct memphy_struct *mp, int fpn, const BYTE *buf)
+{
+   int addr, i;
+
+   if (mp == NULL || fpn < 0 || fpn >= mp->numfp)
+     return -1;
+
+   addr = fpn * PAGING_PAGESZ;
+   if (mp->rdmflg)
+   {
+     memcpy(mp->storage + addr, buf, PAGING_PAGESZ);
+     return 0;
+   }
+
+   memphy_lock(&mp->csr_lock);
+   MEMPHY_mv_csr(mp, addr);
+   for (i = 0; i < PAGING_PAGESZ; i++)
+   {
+     mp->storage[mp->cursor] = buf[i];
+     mp->cursor = (mp->cursor + 1) % mp->maxsz;
+   }
+   memphy_unlock(&mp->csr_lock);
+
+   return 0;
+}
+
+/*
+ *  Free frames are managed by a binary buddy allocator. A free block of
+ *  order k is 2^k frames aligned to its size, and sets bit (fpn >> k)
+ *  in free_area[k]. The per-order bitmaps act as the free lists, a
+ *  word scan finds a block and the buddy of a block is one bit away.
+ */
+
 /*
  *  MEMPHY_format-format MEMPHY device
  *  @mp: memphy struct
+ *
+ *  The device is carved into the largest aligned blocks that fit.
  */
 int MEMPHY_format(struct memphy_struct *mp, int pagesz)
 {
     /* This setting come with fixed constant PAGESZ */
     int numfp = mp->maxsz / pagesz;
-    struct framephy_struct *newfst, *fst;
-    int iter = 0;
+    int order, fpn;
 
     if (numfp <= 0)
       return -1;
 
-    /* Init head of free framephy list */ 
-    fst = malloc(sizeof(struct framephy_struct));
-    fst->fpn = iter;
-    mp->free_fp_list = fst;
+    for (order = 0; order <= MEMPHY_MAX_ORDER; order++)
+    {
+      mp->free_area[order] = calloc(BITS_TO_LONGS((numfp >> order) + 1),
+                                    sizeof(unsigned long));
+      if (mp->free_area[order] == NULL)
+        return -1;
+      mp->nr_free[order] = 0;
+      mp->fp_hint[order] = 0;
+    }
+    mp->numfp = numfp;
+    mp->fp_lock = 0;
+    mp->mag = NULL;
+    mp->nr_mag = 0;
 
-    /* We have list with first element, fill in the rest num-1 element member*/
-    for (iter = 1; iter < numfp ; iter++)
+    fpn = 0;
+    while (fpn < numfp)
     {
-       newfst =  malloc(sizeof(struct framephy_struct));
-       newfst->fpn = iter;
-       newfst->fp_next = NULL;
-       fst->fp_next = newfst;
-       fst = newfst;
+      order = MEMPHY_MAX_ORDER;
+      while (order > 0 && ((fpn & (BIT(order) - 1)) || fpn + BIT(order) > numfp))
+        order--;
+      __set_bit(fpn >> order, mp->free_area[order]);
+      mp->nr_free[order]++;
+      fpn += BIT(order);
     }
 
     return 0;
 }
 
-int MEMPHY_get_freefp(struct memphy_struct *mp, int *retfpn)
+/* Buddy split, the caller holds fp_lock */
+static int __alloc_order(struct memphy_struct *mp, int order, int *retfpn)
+{
+   int cur, blk, nbits;
+
+   for (cur = order; cur <= MEMPHY_MAX_ORDER; cur++)
+     if (mp->nr_free[cur] > 0)
+       break;
+   if (cur > MEMPHY_MAX_ORDER)
+     return -1;
+
+   nbits = (mp->numfp >> cur) + 1;
+   blk = find_next_bit(mp->free_area[cur], nbits, mp->fp_hint[cur]);
+   if (blk >= nbits)
+     blk = find_first_bit(mp->free_area[cur], nbits);
+   mp->fp_hint[cur] = blk + 1;
+   __clear_bit(blk, mp->free_area[cur]);
+   mp->nr_free[cur]--;
+
+   /* Split: keep the lower half, free the upper one */
+   while (cur > order)
+   {
+     cur--;
+     blk <<= 1;
+     __set_bit(blk + 1, mp->free_area[cur]);
+     mp->nr_free[cur]++;
+   }
+
+   *retfpn = blk << order;
+
+   return 0;
+}
+
+/* Buddy merge, the caller holds fp_lock */
+static void __free_order(struct memphy_struct *mp, int fpn, int order)
+{
+   int blk = fpn >> order;
+
+   while (order < MEMPHY_MAX_ORDER && test_bit(blk ^ 1, mp->free_area[order]))
+   {
+     __clear_bit(blk ^ 1, mp->free_area[order]);
+     mp->nr_free[order]--;
+     blk >>= 1;
+     order++;
+   }
+   __set_bit(blk, mp->free_area[order]);
+   mp->nr_free[order]++;
+}
+
+/*
+ *  MEMPHY_alloc_order - take a block of 2^order contiguous frames
+ *  @mp: memphy struct
+ *  @order: block order, at most MEMPHY_MAX_ORDER
+ *  @retfpn: first frame of the block, aligned to its size
+ *
+ *  The smallest free block that fits is split down, the upper halves
+ *  go back to the lower orders. Within an order the search is next
+ *  fit: it starts after the last block taken and wraps around once.
+ */
+int MEMPHY_alloc_order(struct memphy_struct *mp, int order, int *retfpn)
 {
-   struct framephy_struct *fp = mp->free_fp_list;
+   int ret;
 
-   if (fp == NULL)
+   if (order < 0 || order > MEMPHY_MAX_ORDER)
      return -1;
 
-   *retfpn = fp->fpn;
-   mp->free_fp_list = fp->fp_next;
+   memphy_lock(&mp->fp_lock);
+   ret = __alloc_order(mp, order, retfpn);
+   memphy_unlock(&mp->fp_lock);
+
+   return ret;
+}
+
+/*
+ *  MEMPHY_free_order - give back a block of 2^order frames
+ *  @mp: memphy struct
+ *  @fpn: first frame of the block
+ *  @order: block order
+ *
+ *  The block merges with its buddy for as long as the buddy is free.
+ */
+int MEMPHY_free_order(struct memphy_struct *mp, int fpn, int order)
+{
+   if (fpn < 0 || fpn >= mp->numfp || order < 0 || order > MEMPHY_MAX_ORDER ||
+       (fpn & (BIT(order) - 1)))
+     return -1;
 
-   /* MEMPHY is iteratively used up until its exhausted
-    * No garbage collector acting then it not been released
-    */
-   free(fp);
+   memphy_lock(&mp->fp_lock);
+   __free_order(mp, fpn, order);
+   memphy_unlock(&mp->fp_lock);
 
    return 0;
 }
 
+/*
+ *  Magazine top word: a generation in the high half, the number of
+ *  cached frames in the low half. Every change bumps the generation, so
+ *  a CAS from a stale top fails even if the count came back the same.
+ */
+#define MAG_TOP(gen, nr)  (((uint64_t)(uint32_t)(gen) << 32) | (uint32_t)(nr))
+#define MAG_GEN(top)      ((uint32_t)((top) >> 32))
+#define MAG_NR(top)       ((int)(uint32_t)(top))
+
+static inline uint64_t mag_top(struct memphy_mag *mag)
+{
+   return __atomic_load_n(&mag->top, __ATOMIC_ACQUIRE);
+}
+
+static inline int mag_cas(struct memphy_mag *mag, uint64_t old, uint64_t new)
+{
+   return __atomic_compare_exchange_n(&mag->top, &old, new, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ *  MEMPHY_init_mags - give every CPU a magazine of free frames
+ *  @mp: memphy struct
+ *  @ncpus: number of CPUs
+ *
+ *  Single frames then come from the magazine of the CPU asking, with
+ *  no lock: only that CPU pushes and pops, and it does so by a CAS on
+ *  the magazine top. fp_lock is taken once per MEMPHY_MAG_BATCH frames
+ *  moved between a magazine and the buddy pool, and by the drain.
+ */
+int MEMPHY_init_mags(struct memphy_struct *mp, int ncpus)
+{
+   mp->mag = calloc(ncpus, sizeof(struct memphy_mag));
+   if (mp->mag == NULL)
+     return -1;
+   mp->nr_mag = ncpus;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_get_freefp - take one free frame
+ *  @mp: memphy struct
+ *  @cpu: CPU asking, -1 to go straight to the shared pool
+ *  @retfpn: obtained frame
+ */
+int MEMPHY_get_freefp(struct memphy_struct *mp, int cpu, int *retfpn)
+{
+   struct memphy_mag *mag;
+   uint64_t top;
+   int nr, fpn;
+
+   if (cpu < 0 || cpu >= mp->nr_mag)
+     return MEMPHY_alloc_order(mp, 0, retfpn);
+
+   mag = &mp->mag[cpu];
+   for (;;)
+   {
+     top = mag_top(mag);
+     nr = MAG_NR(top);
+     if (nr > 0)
+     {
+       fpn = __atomic_load_n(&mag->fpn[nr - 1], __ATOMIC_RELAXED);
+       if (mag_cas(mag, top, MAG_TOP(MAG_GEN(top) + 1, nr - 1)))
+         break;
+       continue; /* Drained under us */
+     }
+
+     /* Slow path: refill a batch from the pool. The drain is the only
+      * other writer of the top and it holds fp_lock too */
+     memphy_lock(&mp->fp_lock);
+     top = mag_top(mag);
+     nr = MAG_NR(top);
+     while (nr < MEMPHY_MAG_BATCH && __alloc_order(mp, 0, &fpn) == 0)
+       __atomic_store_n(&mag->fpn[nr++], fpn, __ATOMIC_RELAXED);
+     __atomic_store_n(&mag->top, MAG_TOP(MAG_GEN(top) + 1, nr),
+                      __ATOMIC_RELEASE);
+     memphy_unlock(&mp->fp_lock);
+
+     if (nr == 0)
+       return -1;
+   }
+
+   *retfpn = fpn;
+
+   return 0;
+}
+
+/*
+ *  MEMPHY_put_freefp - give back one frame
+ *  @mp: memphy struct
+ *  @cpu: CPU giving it back, -1 to go straight to the shared pool
+ *  @fpn: released frame
+ */
+int MEMPHY_put_freefp(struct memphy_struct *mp, int cpu, int fpn)
+{
+   struct memphy_mag *mag;
+   uint64_t top;
+   int nr;
+
+   if (cpu < 0 || cpu >= mp->nr_mag)
+     return MEMPHY_free_order(mp, fpn, 0);
+
+   if (fpn < 0 || fpn >= mp->numfp)
+     return -1;
+
+   mag = &mp->mag[cpu];
+   for (;;)
+   {
+     top = mag_top(mag);
+     nr = MAG_NR(top);
+     if (nr < MEMPHY_MAG_SIZE)
+     { /* The slot is above the top, a drain does not read it */
+       __atomic_store_n(&mag->fpn[nr], fpn, __ATOMIC_RELAXED);
+       if (mag_cas(mag, top, MAG_TOP(MAG_GEN(top) + 1, nr + 1)))
+         return 0;
+       continue;
+     }
+
+     /* Slow path: spill a batch back so the buddies can merge */
+     memphy_lock(&mp->fp_lock);
+     top = mag_top(mag);
+     nr = MAG_NR(top);
+     while (nr > MEMPHY_MAG_SIZE - MEMPHY_MAG_BATCH)
+       __free_order(mp, __atomic_load_n(&mag->fpn[--nr], __ATOMIC_RELAXED), 0);
+     __atomic_store_n(&mag->top, MAG_TOP(MAG_GEN(top) + 1, nr),
+                      __ATOMIC_RELEASE);
+     memphy_unlock(&mp->fp_lock);
+   }
+}
+
+/*
+ *  MEMPHY_drain_mags - give every frame cached in a magazine back
+ *  @mp: memphy struct
+ *
+ *  Called before an allocation fails, as the free frames may all be
+ *  sitting in the magazines of other CPUs. The frames below the top are
+ *  copied out and the magazine emptied by a CAS, so an owner popping
+ *  meanwhile makes the CAS fail and the copy is taken again. Return the
+ *  frames drained.
+ */
+int MEMPHY_drain_mags(struct memphy_struct *mp)
+{
+   struct memphy_mag *mag;
+   int fpn[MEMPHY_MAG_SIZE];
+   uint64_t top;
+   int cpu, i, nr, drained = 0;
+
+   memphy_lock(&mp->fp_lock);
+   for (cpu = 0; cpu < mp->nr_mag; cpu++)
+   {
+     mag = &mp->mag[cpu];
+     do {
+       top = mag_top(mag);
+       nr = MAG_NR(top);
+       for (i = 0; i < nr; i++)
+         fpn[i] = __atomic_load_n(&mag->fpn[i], __ATOMIC_RELAXED);
+     } while (nr > 0 && !mag_cas(mag, top, MAG_TOP(MAG_GEN(top) + 1, 0)));
+
+     for (i = 0; i < nr; i++)
+       __free_order(mp, fpn[i], 0);
+     drained += nr;
+   }
+   memphy_unlock(&mp->fp_lock);
+
+   return drained;
+}
+
 int MEMPHY_dump(struct memphy_struct * mp)
 {
     /*TODO dump memphy contnt mp->storage 
@@ -164,20 +523,50 @@ int MEMPHY_dump(struct memphy_struct * mp)
     return 0;
 }
 
-int MEMPHY_put_freefp(struct memphy_struct *mp, int fpn)
+/*
+ *  MEMPHY_frag_dump - print buddy free lists and fragmentation
+ *  @mp: memphy struct
+ *
+ *  Fragmentation is the share of free frames sitting in blocks smaller
+ *  than the largest free one: 0% when all free memory is in blocks of
+ *  the top order. Frames cached in the magazines are free single frames.
+ */
+int MEMPHY_frag_dump(struct memphy_struct *mp)
 {
-   struct framephy_struct *fp = mp->free_fp_list;
-   struct framephy_struct *newnode = malloc(sizeof(struct framephy_struct));
+   int order, largest = -1, cpu, cached = 0;
+   long nfree = 0, nlargest = 0;
+
+   for (cpu = 0; cpu < mp->nr_mag; cpu++)
+     cached += MAG_NR(mag_top(&mp->mag[cpu]));
 
-   /* Create new node with value fpn */
-   newnode->fpn = fpn;
-   newnode->fp_next = fp;
-   mp->free_fp_list = newnode;
+   for (order = 0; order <= MEMPHY_MAX_ORDER; order++)
+   {
+     nfree += (long)mp->nr_free[order] << order;
+     if (mp->nr_free[order] > 0)
+       largest = order;
+   }
+   nfree += cached;
+   if (largest > 0)
+     nlargest = (long)mp->nr_free[largest] << largest;
+   else if (nfree > 0)
+   {
+     largest = 0;
+     nlargest = nfree;
+   }
+
+   printf("MEMPHY: %ld/%d frames free, %d in CPU magazines, blocks per order:",
+          nfree, mp->numfp, cached);
+   for (order = 0; order <= MEMPHY_MAX_ORDER; order++)
+     printf(" %d", mp->nr_free[order] + (order == 0 ? cached : 0));
+   if (largest < 0)
+     printf(", no free block\n");
+   else
+     printf(", largest block %ld frames, fragmentation %.1f%%\n",
+            (long)BIT(largest), 100.0 * (nfree - nlargest) / nfree);
 
    return 0;
 }
 
-
 /*
  *  Init MEMPHY struct
  */
@@ -189,6 +578,8 @@ int init_memphy(struct memphy_struct *mp, int max_size, int randomflg)
    MEMPHY_format(mp,PAGING_PAGESZ);
 
    mp->rdmflg = (randomflg != 0)?1:0;
+   mp->csr_lock = 0;
+   mp->seek_slots = 0;
 
    if (!mp->rdmflg )   /* Not Ramdom acess device, then it serial device*/
       mp->cursor = 0;
@@ -0,0 +1,152 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Swap daemon module mm/mm-swapd.c
+ *
+ * A process faulting on a swapped page does not copy it in on its CPU:
+ * it hands the page to the swap daemon and blocks, so the CPU runs
+ * another process meanwhile. The daemon is a timer device of its own.
+ * A request completes [latency] slots after it was submitted, plus the
+ * seeks a sequential swap device had to do for it, then the process
+ * goes back to the run queue and retries its access. The device serves
+ * one request at a time, so a request never completes before the one
+ * submitted ahead of it.
+ */
+
+#include "mm.h"
+#include "timer.h"
+#include "sched.h"
+#include "queue.h"
+#include <stdio.h>
+
+static struct timer_id_t *swapd_timer;
+static int swapd_latency;
+static int swapd_stopping;
+static struct queue_t swapd_inbox;   /* submitted by the CPUs */
+static struct pcb_list_t swapd_pending; /* daemon only, by swap_ready */
+static uint64_t swapd_busy_until;       /* daemon only */
+
+/*
+ *  init_swapd - set up the swap daemon
+ *  @timer_id: timer device the daemon runs as
+ *  @latency: slots a page transfer takes
+ */
+int init_swapd(struct timer_id_t *timer_id, int latency)
+{
+  swapd_latency = latency;
+  swapd_stopping = 0;
+  __atomic_store_n(&swapd_timer, timer_id, __ATOMIC_SEQ_CST);
+
+  return 0;
+}
+
+/*
+ *  swapd_active - whether page faults go through the swap daemon
+ */
+int swapd_active(void)
+{
+  return __atomic_load_n(&swapd_timer, __ATOMIC_SEQ_CST) != NULL;
+}
+
+/*
+ *  swapd_submit - queue the swap-in [proc] is blocked on
+ *  @proc: process whose swap_pgn is to be brought in
+ *
+ *  Called by the CPU that took [proc] off, within its time slot.
+ */
+int swapd_submit(struct pcb_t *proc)
+{
+  proc->swap_ready = current_time() + swapd_latency;
+  enqueue(&swapd_inbox, proc);
+  timer_unpark(swapd_timer);
+
+  return 0;
+}
+
+/*
+ *  swapd_stop - let the daemon exit once its requests are done
+ *  Called by the last CPU to stop, within its time slot.
+ */
+int swapd_stop(void)
+{
+  __atomic_store_n(&swapd_stopping, 1, __ATOMIC_SEQ_CST);
+  timer_unpark(swapd_timer);
+
+  return 0;
+}
+
+/*
+ *  swapd_start - do the transfer of a new request, time its completion
+ *  @proc: process blocked on swap-in
+ *
+ *  The process stays blocked until swap_ready, so the page may well be
+ *  in place already. Its swap_pgn is left for swapd_complete, or set
+ *  to -2 if the transfer failed.
+ */
+static void swapd_start(struct pcb_t *proc)
+{
+  struct memphy_struct *swp = proc->active_mswp;
+  unsigned long seek = swp->seek_slots;
+
+  if (swap_in_page(proc->mm, proc->swap_pgn, proc, -1) != 0)
+    proc->swap_pgn = -2;
+
+  if (proc->swap_ready < swapd_busy_until)
+    proc->swap_ready = swapd_busy_until;
+  proc->swap_ready += swp->seek_slots - seek;
+  swapd_busy_until = proc->swap_ready;
+
+  list_enqueue(&swapd_pending, proc);
+}
+
+/*
+ *  swapd_complete - wake the process of a due request
+ *  @proc: process blocked on swap-in
+ */
+static void swapd_complete(struct pcb_t *proc)
+{
+  if (proc->swap_pgn >= 0) {
+    printf("\tSWAPD: Page %d of process %2d swapped in\n",
+           proc->swap_pgn, proc->pid);
+    proc->swap_pgn = -1;
+  } else {
+    printf("\tSWAPD: Swap-in of process %2d failed\n", proc->pid);
+  }
+  wake_proc(proc);
+}
+
+/*
+ *  swapd_routine - body of the swap daemon device
+ *  @arg: its timer device
+ *
+ *  Sleeps while there is no request, otherwise idles until the earliest
+ *  one is due. Requests fall due in submission order.
+ */
+void *swapd_routine(void *arg)
+{
+  struct timer_id_t *timer_id = (struct timer_id_t *)arg;
+  struct pcb_t *proc;
+
+  while (1) {
+    while ((proc = dequeue(&swapd_inbox)) != NULL)
+      swapd_start(proc);
+
+    while (!list_empty(&swapd_pending) &&
+           swapd_pending.head->swap_ready <= current_time())
+      swapd_complete(list_dequeue(&swapd_pending));
+
+    if (!list_empty(&swapd_pending))
+      idle_slot(timer_id, swapd_pending.head->swap_ready);
+    else if (__atomic_load_n(&swapd_stopping, __ATOMIC_SEQ_CST))
+      break;
+    else
+      timer_park(timer_id);
+  }
+
+  detach_event(timer_id);
+  free_queue(&swapd_inbox);
+
+  return NULL;
+}
+
+//#endif
@@ -0,0 +1,248 @@
+//#ifdef MM_PAGING
+/*
+ * PAGING based Memory Management
+ * Software TLB module mm/mm-tlb.c
+ *
+ * Each CPU owns a small set-associative cache of (mm, pgn) -> FPN
+ * translations, probed before the page table walk. A page hashes to
+ * one set, the same on every CPU, so shooting a translation down only
+ * looks at PAGING_TLB_WAYS entries per CPU. Only a whole address space
+ * going away costs a scan of every entry.
+ * Only the CPU running a process fills or probes its own TLB; other
+ * CPUs merely invalidate entries in it, so the owner field, NULL if
+ * the entry is invalid, is accessed atomically and published last.
+ */
+
+#include "mm.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+struct tlb_entry_t {
+  struct mm_struct *mm; /* NULL if the entry is invalid */
+  int pgn;
+  int fpn;
+};
+
+struct tlb_struct {
+  struct tlb_entry_t set[PAGING_TLB_SETS][PAGING_TLB_WAYS];
+  unsigned char victim[PAGING_TLB_SETS]; /* round-robin replacement */
+  unsigned long hits;
+  unsigned long misses;
+};
+
+static struct tlb_struct *tlb;
+static int tlb_nr_cpus;
+
+/*
+ *  tlb_set_of - hash a page to its set
+ *  @mm: address space of the page
+ *  @pgn: page number
+ */
+static inline int tlb_set_of(struct mm_struct *mm, int pgn)
+{
+  uintptr_t key = (uintptr_t)mm / sizeof(struct mm_struct);
+
+  return (pgn ^ key) & (PAGING_TLB_SETS - 1);
+}
+
+/*
+ *  tlb_drop - invalidate an entry if it still translates a page
+ *  @e: entry
+ *  @mm: address space of the page
+ *  @pgn: page number
+ */
+static inline void tlb_drop(struct tlb_entry_t *e, struct mm_struct *mm,
+                            int pgn)
+{
+  struct mm_struct *cur = mm;
+
+  if (__atomic_load_n(&e->mm, __ATOMIC_RELAXED) != mm ||
+      __atomic_load_n(&e->pgn, __ATOMIC_RELAXED) != pgn)
+    return;
+
+  __atomic_compare_exchange_n(&e->mm, &cur, NULL, 0,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ *  tlb_of - the TLB of a CPU, NULL if none
+ *  @cpu: CPU doing the access
+ */
+static inline struct tlb_struct *tlb_of(int cpu)
+{
+  if (tlb == NULL || cpu < 0 || cpu >= tlb_nr_cpus)
+    return NULL;
+
+  return &tlb[cpu];
+}
+
+/*
+ *  tlb_lookup - translate a page through the TLB of a CPU
+ *  @cpu: CPU doing the access
+ *  @mm: address space of the page
+ *  @pgn: page number
+ *  @fpn: return FPN on hit
+ *
+ *  Return 0 on hit, -1 on miss.
+ */
+int tlb_lookup(int cpu, struct mm_struct *mm, int pgn, int *fpn)
+{
+  struct tlb_struct *t = tlb_of(cpu);
+  struct tlb_entry_t *e;
+  int way;
+
+  if (t == NULL)
+    return -1;
+
+  e = t->set[tlb_set_of(mm, pgn)];
+  for (way = 0; way < PAGING_TLB_WAYS; way++) {
+    if (__atomic_load_n(&e[way].mm, __ATOMIC_ACQUIRE) == mm &&
+        __atomic_load_n(&e[way].pgn, __ATOMIC_RELAXED) == pgn) {
+      *fpn = e[way].fpn;
+      t->hits++;
+      return 0;
+    }
+  }
+
+  t->misses++;
+  return -1;
+}
+
+/*
+ *  tlb_fill - cache a translation after a page walk
+ *  @cpu: CPU doing the access
+ *  @mm: address space of the page
+ *  @pgn: page number
+ *  @fpn: frame the page lives in
+ */
+int tlb_fill(int cpu, struct mm_struct *mm, int pgn, int fpn)
+{
+  struct tlb_struct *t = tlb_of(cpu);
+  struct tlb_entry_t *e;
+  int set;
+
+  if (t == NULL)
+    return -1;
+
+  set = tlb_set_of(mm, pgn);
+  e = &t->set[set][t->victim[set]];
+  t->victim[set] = (t->victim[set] + 1) % PAGING_TLB_WAYS;
+
+  __atomic_store_n(&e->mm, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&e->pgn, pgn, __ATOMIC_RELAXED);
+  e->fpn = fpn;
+  __atomic_store_n(&e->mm, mm, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+/*
+ *  tlb_flush_page - drop the translation of a page from every CPU
+ *  @mm: address space of the page
+ *  @pgn: page about to be remapped
+ */
+int tlb_flush_page(struct mm_struct *mm, int pgn)
+{
+  int cpu, way, set;
+
+  if (tlb == NULL)
+    return 0;
+
+  set = tlb_set_of(mm, pgn);
+  for (cpu = 0; cpu < tlb_nr_cpus; cpu++)
+    for (way = 0; way < PAGING_TLB_WAYS; way++)
+      tlb_drop(&tlb[cpu].set[set][way], mm, pgn);
+
+  return 0;
+}
+
+/*
+ *  tlb_flush_range - drop the translations of some pages from every CPU
+ *  @mm: address space of the pages
+ *  @pgn: first page
+ *  @nr: number of pages
+ */
+int tlb_flush_range(struct mm_struct *mm, int pgn, int nr)
+{
+  int cpu, set, way;
+
+  if (tlb == NULL)
+    return 0;
+
+  /* Past one page per set, a single pass over each TLB is cheaper */
+  if (nr < PAGING_TLB_SETS) {
+    for (; nr > 0; nr--, pgn++)
+      tlb_flush_page(mm, pgn);
+    return 0;
+  }
+
+  for (cpu = 0; cpu < tlb_nr_cpus; cpu++) {
+    for (set = 0; set < PAGING_TLB_SETS; set++) {
+      struct tlb_entry_t *e = tlb[cpu].set[set];
+
+      for (way = 0; way < PAGING_TLB_WAYS; way++) {
+        int cur = __atomic_load_n(&e[way].pgn, __ATOMIC_RELAXED);
+
+        if (cur >= pgn && cur < pgn + nr)
+          tlb_drop(&e[way], mm, cur);
+      }
+    }
+  }
+
+  return 0;
+}
+
+/*
+ *  tlb_flush_mm - drop every translation of an address space
+ *  @mm: address space being torn down
+ */
+int tlb_flush_mm(struct mm_struct *mm)
+{
+  return tlb_flush_range(mm, 0, PAGING_MAX_PGN);
+}
+
+/*
+ *  tlb_dump - print the hit/miss counters of each CPU
+ *  Nothing is printed if no paged access went through the TLB.
+ */
+int tlb_dump(void)
+{
+  unsigned long hits = 0, misses = 0;
+  int cpu;
+
+  if (tlb == NULL)
+    return -1;
+
+  for (cpu = 0; cpu < tlb_nr_cpus; cpu++) {
+    hits += tlb[cpu].hits;
+    misses += tlb[cpu].misses;
+  }
+  if (hits + misses == 0)
+    return 0;
+
+  printf("TLB:\n");
+  for (cpu = 0; cpu < tlb_nr_cpus; cpu++)
+    printf("\tCPU %d: %lu hits, %lu misses\n",
+           cpu, tlb[cpu].hits, tlb[cpu].misses);
+  printf("\ttotal: %lu hits, %lu misses (%.1f%% hit rate)\n",
+         hits, misses, 100.0 * hits / (hits + misses));
+
+  return 0;
+}
+
+/*
+ *  init_tlb - create one empty TLB per CPU
+ *  @ncpus: number of CPUs
+ */
+int init_tlb(int ncpus)
+{
+  tlb = calloc(ncpus, sizeof(struct tlb_struct));
+  if (tlb == NULL)
+    return -1;
+
+  tlb_nr_cpus = ncpus;
+
+  return 0;
+}
+
+//#endif
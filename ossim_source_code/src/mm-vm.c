@@ -16,18 +16,14 @@
  */
 int enlist_vm_freerg_list(struct mm_struct *mm, struct vm_rg_struct rg_elmt)
 {
-  struct vm_rg_struct *rg_node = mm->mmap->vm_freerg_list;
+  struct vm_area_struct *vma = get_vma_by_num(mm, rg_elmt.vmaid);
 
-  if (rg_elmt.rg_start >= rg_elmt.rg_end)
+  if (vma == NULL || rg_elmt.rg_start >= rg_elmt.rg_end)
     return -1;
 
-  if (rg_node != NULL)
-    rg_elmt.rg_next = rg_node;
-
-  /* Enlist the new region */
-  mm->mmap->vm_freerg_list = &rg_elmt;
-
-  return 0;
+  /* Enlist a copy of the new region on the free list of its vma */
+  return enlist_vm_rg_node(&vma->vm_freerg_list,
+             init_vm_rg(rg_elmt.rg_start, rg_elmt.rg_end, rg_elmt.vmaid));
 }
 
 /*get_vma_by_num - get vm area by numID
@@ -63,7 +59,7 @@ struct vm_area_struct *get_vma_by_num(struct mm_struct *mm, int vmaid)
  */
 struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
 {
-  if(rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
+  if(rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ)
     return NULL;
 
   return &mm->symrgtbl[rgid];
@@ -71,20 +67,23 @@ struct vm_rg_struct *get_symrg_byid(struct mm_struct *mm, int rgid)
 
 /*__alloc - allocate a region memory
  *@caller: caller
+ *@cpu: CPU executing the caller
  *@vmaid: ID vm area to alloc memory region
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size 
  *@alloc_addr: address of allocated memory region
  *
  */
-int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr)
+int __alloc(struct pcb_t *caller, int cpu, int vmaid, int rgid, int size, int *alloc_addr)
 {
   /*Allocate at the toproof */
   struct vm_rg_struct rgnode;
+  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
-  /* TODO: commit the vmaid */
-  // rgnode.vmaid
+  if (cur_vma == NULL || rgid < 0 || rgid >= PAGING_MAX_SYMTBL_SZ || size <= 0)
+    return -1;
 
+  rgnode.vmaid = vmaid;
   if (get_free_vmrg_area(caller, vmaid, size, &rgnode) == 0)
   {
     caller->mm->symrgtbl[rgid].rg_start = rgnode.rg_start;
@@ -97,86 +96,75 @@ int __alloc(struct pcb_t *caller, int vmaid, int rgid, int size, int *alloc_addr
     return 0;
   }
 
-  /* TODO: get_free_vmrg_area FAILED handle the region management (Fig.6)*/
-
-  /* TODO retrive current vma if needed, current comment out due to compiler redundant warning*/
-  /*Attempt to increate limit to get space */
-  //struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
-
-
+  /* No free region fits: grow the vma at its break (Fig.6) */
   int inc_sz = PAGING_PAGE_ALIGNSZ(size);
   int inc_limit_ret;
+  int old_sbrk = cur_vma->sbrk;
 
-  /* TODO retrive old_sbrk if needed, current comment out due to compiler redundant warning*/
-  //int old_sbrk = cur_vma->sbrk;
+  if (inc_vma_limit(caller, cpu, vmaid, inc_sz, &inc_limit_ret) < 0)
+    return -1; /* Out of address space or of memory, nothing changed */
 
-  /* TODO INCREASE THE LIMIT
-   * inc_vma_limit(caller, vmaid, inc_sz)
-   */
-  inc_vma_limit(caller, vmaid, inc_sz, &inc_limit_ret);
+  caller->mm->symrgtbl[rgid].rg_start = old_sbrk;
+  caller->mm->symrgtbl[rgid].rg_end = old_sbrk + size;
+  caller->mm->symrgtbl[rgid].vmaid = vmaid;
 
-  /* TODO: commit the limit increment */
+  /* The rest of the last page is left for later allocations */
+  rgnode.rg_start = old_sbrk + size;
+  rgnode.rg_end = old_sbrk + inc_sz;
+  enlist_vm_freerg_list(caller->mm, rgnode);
 
-  /* TODO: commit the allocation address 
-  // *alloc_addr = ...
-  */
+  *alloc_addr = old_sbrk;
 
   return 0;
 }
 
 /*__free - remove a region memory
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
  *@rgid: memory region ID (used to identify variable in symbole table)
- *@size: allocated size 
  *
+ *  The region goes back to the free list of its vma, its pages stay
+ *  mapped for the allocations that reuse it.
  */
 int __free(struct pcb_t *caller, int rgid)
 {
-  struct vm_rg_struct rgnode;
-
-  // Dummy initialization for avoding compiler dummay warning
-  // in incompleted TODO code rgnode will overwrite through implementing
-  // the manipulation of rgid later
-  rgnode.vmaid = 0;  //dummy initialization
-  rgnode.vmaid = 1;  //dummy initialization
+  struct vm_rg_struct *rgnode = get_symrg_byid(caller->mm, rgid);
 
-  if(rgid < 0 || rgid > PAGING_MAX_SYMTBL_SZ)
-    return -1;
-
-  /* TODO: Manage the collect freed region to freerg_list */
-  
+  if (rgnode == NULL || rgnode->rg_start >= rgnode->rg_end)
+    return -1; /* Invalid or not allocated */
 
   /*enlist the obsoleted memory region */
-  enlist_vm_freerg_list(caller->mm, rgnode);
+  enlist_vm_freerg_list(caller->mm, *rgnode);
+  rgnode->rg_start = rgnode->rg_end = 0;
 
   return 0;
 }
 
 /*pgalloc - PAGING-based allocate a region memory
  *@proc:  Process executing the instruction
+ *@cpu: CPU executing it
  *@size: allocated size 
  *@reg_index: memory region ID (used to identify variable in symbole table)
  */
-int pgalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
+int pgalloc(struct pcb_t *proc, int cpu, uint32_t size, uint32_t reg_index)
 {
   int addr;
 
   /* By default using vmaid = 0 */
-  return __alloc(proc, 0, reg_index, size, &addr);
+  return __alloc(proc, cpu, 0, reg_index, size, &addr);
 }
 
 /*pgmalloc - PAGING-based allocate a region memory
  *@proc:  Process executing the instruction
+ *@cpu: CPU executing it
  *@size: allocated size 
  *@reg_index: memory region ID (used to identify vaiable in symbole table)
  */
-int pgmalloc(struct pcb_t *proc, uint32_t size, uint32_t reg_index)
+int pgmalloc(struct pcb_t *proc, int cpu, uint32_t size, uint32_t reg_index)
 {
   int addr;
 
   /* By default using vmaid = 1 */
-  return __alloc(proc, 1, reg_index, size, &addr);
+  return __alloc(proc, cpu, 1, reg_index, size, &addr);
 }
 
 /*pgfree - PAGING-based free a region memory
@@ -190,50 +178,118 @@ int pgfree_data(struct pcb_t *proc, uint32_t reg_index)
    return __free(proc, reg_index);
 }
 
-/*pg_getpage - get the page in ram
+/*swap_out_page - free a frame of MEMRAM by sending a page to MEMSWP
  *@mm: memory region
- *@pagenum: PGN
- *@framenum: return FPN
- *@caller: caller
+ *@caller: process owning the page
+ *@cpu: CPU whose frame magazines to use, -1 for the shared pools
+ *@retfpn: the frame given up
  *
+ *  The victim is the oldest page of the caller still online.
  */
-int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
+int swap_out_page(struct mm_struct *mm, struct pcb_t *caller, int cpu, int *retfpn)
 {
-  uint32_t pte = mm->pgd[pgn];
- 
-  if (!PAGING_PTE_PAGE_PRESENT(pte))
-  { /* Page is not online, make it actively living */
-    int vicpgn, swpfpn; 
-    //int vicfpn;
-    //uint32_t vicpte;
+  int vicpgn, swpfpn, vicfpn;
+  uint32_t *vicpte;
+
+  /* Get free frame in MEMSWP first, the victim stays online otherwise */
+  if (MEMPHY_get_freefp(caller->active_mswp, cpu, &swpfpn) != 0)
+    return -1;
+
+  /* Find victim page */
+  if (find_victim_page(mm, &vicpgn) != 0)
+  {
+    MEMPHY_put_freefp(caller->active_mswp, cpu, swpfpn);
+    return -1;
+  }
+  /* Swap works on base pages, split the victim if it is huge */
+  pte_demote(mm, vicpgn);
+  vicpte = pte_lookup(mm, vicpgn);
+  vicfpn = PAGING_PTE_FPN(*vicpte);
+  /* Its frame is about to be reused, no CPU may keep translating it */
+  tlb_flush_page(mm, vicpgn);
+
+  /* Copy victim frame to swap */
+  __swap_cp_page(caller->mram, vicfpn, caller->active_mswp, swpfpn);
+  pte_set_swap(vicpte, 0, swpfpn);
+
+#ifdef IODUMP
+  printf("swap out page=%d frame=%d to swap frame=%d\n", vicpgn, vicfpn, swpfpn);
+#endif
+
+  *retfpn = vicfpn;
+
+  return 0;
+}
+
+/*swap_in_page - bring a swapped page back to MEMRAM
+ *@mm: memory region
+ *@pgn: PGN of a swapped page
+ *@caller: process owning the page
+ *@cpu: CPU whose frame magazines to use, -1 for the shared pools
+ *
+ *  A victim page of the caller goes out to MEMSWP and the page takes
+ *  over its frame.
+ */
+int swap_in_page(struct mm_struct *mm, int pgn, struct pcb_t *caller, int cpu)
+{
+  uint32_t *ptep = pte_lookup(mm, pgn);
+  int vicfpn, tgtfpn;
 
-    int tgtfpn = PAGING_PTE_SWP(pte);//the target frame storing our variable
+  if (ptep == NULL || !(*ptep & PAGING_PTE_SWAPPED_MASK))
+    return -1;
 
-    /* TODO: Play with your paging theory here */
-    /* Find victim page */
-    find_victim_page(caller->mm, &vicpgn);
+  tgtfpn = PAGING_PTE_SWP(*ptep);//the target frame storing our variable
 
-    /* Get free frame in MEMSWP */
-    MEMPHY_get_freefp(caller->active_mswp, &swpfpn);
+  /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
+  if (swap_out_page(mm, caller, cpu, &vicfpn) != 0)
+    return -1;
 
+  /* Copy target frame from swap to mem */
+  __swap_cp_page(caller->active_mswp, tgtfpn, caller->mram, vicfpn);
+  MEMPHY_put_freefp(caller->active_mswp, cpu, tgtfpn);
 
-    /* Do swap frame from MEMRAM to MEMSWP and vice versa*/
-    /* Copy victim frame to swap */
-    //__swap_cp_page();
-    /* Copy target frame from swap to mem */
-    //__swap_cp_page();
+  /* Update its online status of the target page */
+  pte_set_fpn(ptep, vicfpn);
 
-    /* Update page table */
-    //pte_set_swap() &mm->pgd;
+  enlist_pgn_node(&mm->fifo_pgn, pgn);
+
+  return 0;
+}
 
-    /* Update its online status of the target page */
-    //pte_set_fpn() & mm->pgd[pgn];
-    pte_set_fpn(&pte, tgtfpn);
+/*pg_getpage - get the page in ram
+ *@mm: memory region
+ *@pagenum: PGN
+ *@framenum: return FPN (first frame of a huge page)
+ *@caller: caller
+ *@cpu: CPU executing the caller
+ *
+ *  Return PAGING_PG_INFLIGHT if the page has been handed to the swap
+ *  daemon: the caller must leave the CPU and retry the access later.
+ */
+int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller,
+               int cpu)
+{
+  uint32_t *ptep = pte_lookup(mm, pgn);
 
-    enlist_pgn_node(&caller->mm->fifo_pgn,pgn);
+  if (ptep == NULL || !PAGING_PTE_PAGE_PRESENT(*ptep))
+    return -1; /* the page was never mapped */
+ 
+  if (*ptep & PAGING_PTE_SWAPPED_MASK)
+  { /* Page is not online, make it actively living */
+    if (caller->swap_pgn == -2) {
+      /* The swap daemon could not bring it in */
+      caller->swap_pgn = -1;
+      return -1;
+    }
+    if (swapd_active()) {
+      caller->swap_pgn = pgn;
+      return PAGING_PG_INFLIGHT;
+    }
+    if (swap_in_page(mm, pgn, caller, cpu) != 0)
+      return -1;
   }
 
-  *fpn = PAGING_PTE_FPN(pte);
+  *fpn = PAGING_PTE_FPN(*ptep);
 
   return 0;
 }
@@ -242,17 +298,26 @@ int pg_getpage(struct mm_struct *mm, int pgn, int *fpn, struct pcb_t *caller)
  *@mm: memory region
  *@addr: virtual address to acess 
  *@value: value
+ *@cpu: CPU executing the caller
  *
  */
-int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
+int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller,
+              int cpu)
 {
   int pgn = PAGING_PGN(addr);
   int off = PAGING_OFFST(addr);
   int fpn;
 
   /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
-    return -1; /* invalid page access */
+  if (tlb_lookup(cpu, mm, pgn, &fpn) != 0) {
+    int ret = pg_getpage(mm, pgn, &fpn, caller, cpu);
+
+    if (ret != 0)
+      return ret; /* invalid page access, or swapping in */
+    if (PAGING_PTE_PAGE_HUGE(*pte_lookup(mm, pgn)))
+      fpn += PAGING_HUGE_IDX(pgn);
+    tlb_fill(cpu, mm, pgn, fpn);
+  }
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -265,17 +330,26 @@ int pg_getval(struct mm_struct *mm, int addr, BYTE *data, struct pcb_t *caller)
  *@mm: memory region
  *@addr: virtual address to acess 
  *@value: value
+ *@cpu: CPU executing the caller
  *
  */
-int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
+int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller,
+              int cpu)
 {
   int pgn = PAGING_PGN(addr);
   int off = PAGING_OFFST(addr);
   int fpn;
 
   /* Get the page to MEMRAM, swap from MEMSWAP if needed */
-  if(pg_getpage(mm, pgn, &fpn, caller) != 0) 
-    return -1; /* invalid page access */
+  if (tlb_lookup(cpu, mm, pgn, &fpn) != 0) {
+    int ret = pg_getpage(mm, pgn, &fpn, caller, cpu);
+
+    if (ret != 0)
+      return ret; /* invalid page access, or swapping in */
+    if (PAGING_PTE_PAGE_HUGE(*pte_lookup(mm, pgn)))
+      fpn += PAGING_HUGE_IDX(pgn);
+    tlb_fill(cpu, mm, pgn, fpn);
+  }
 
   int phyaddr = (fpn << PAGING_ADDR_FPN_LOBIT) + off;
 
@@ -286,37 +360,38 @@ int pg_setval(struct mm_struct *mm, int addr, BYTE value, struct pcb_t *caller)
 
 /*__read - read value in region memory
  *@caller: caller
+ *@cpu: CPU executing the caller
  *@vmaid: ID vm area to alloc memory region
  *@offset: offset to acess in memory region 
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size 
  *
  */
-int __read(struct pcb_t *caller, int rgid, int offset, BYTE *data)
+int __read(struct pcb_t *caller, int cpu, int rgid, int offset, BYTE *data)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
-  int vmaid = currg->vmaid;
 
-  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
-
-  if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  if(currg == NULL || offset < 0 ||
+     currg->rg_start + offset >= currg->rg_end) /* Invalid memory identify */
 	  return -1;
 
-  pg_getval(caller->mm, currg->rg_start + offset, data, caller);
-
-  return 0;
+  return pg_getval(caller->mm, currg->rg_start + offset, data, caller, cpu);
 }
 
 
 /*pgwrite - PAGING-based read a region memory */
 int pgread(
 		struct pcb_t * proc, // Process executing the instruction
+		int cpu, // CPU executing it
 		uint32_t source, // Index of source register
 		uint32_t offset, // Source address = [source] + [offset]
 		uint32_t destination) 
 {
   BYTE data;
-  int val = __read(proc, source, offset, &data);
+  int val = __read(proc, cpu, source, offset, &data);
+
+  if (val != 0)
+    return val; /* failed, or dumped when the read is retried */
 
   destination = (uint32_t) data;
 #ifdef IODUMP
@@ -332,34 +407,37 @@ int pgread(
 
 /*__write - write a region memory
  *@caller: caller
+ *@cpu: CPU executing the caller
  *@vmaid: ID vm area to alloc memory region
  *@offset: offset to acess in memory region 
  *@rgid: memory region ID (used to identify variable in symbole table)
  *@size: allocated size 
  *
  */
-int __write(struct pcb_t *caller, int rgid, int offset, BYTE value)
+int __write(struct pcb_t *caller, int cpu, int rgid, int offset, BYTE value)
 {
   struct vm_rg_struct *currg = get_symrg_byid(caller->mm, rgid);
-  int vmaid = currg->vmaid;
 
-  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
-  
-  if(currg == NULL || cur_vma == NULL) /* Invalid memory identify */
+  if(currg == NULL || offset < 0 ||
+     currg->rg_start + offset >= currg->rg_end) /* Invalid memory identify */
 	  return -1;
 
-  pg_setval(caller->mm, currg->rg_start + offset, value, caller);
-
-  return 0;
+  return pg_setval(caller->mm, currg->rg_start + offset, value, caller, cpu);
 }
 
 /*pgwrite - PAGING-based write a region memory */
 int pgwrite(
 		struct pcb_t * proc, // Process executing the instruction
+		int cpu, // CPU executing it
 		BYTE data, // Data to be wrttien into memory
 		uint32_t destination, // Index of destination register
 		uint32_t offset)
 {
+  int val = __write(proc, cpu, destination, offset, data);
+
+  if (val != 0)
+    return val; /* failed, or dumped when the write is retried */
+
 #ifdef IODUMP
   printf("write region=%d offset=%d value=%d\n", destination, offset, data);
 #ifdef PAGETBL_DUMP
@@ -368,34 +446,73 @@ int pgwrite(
   MEMPHY_dump(proc->mram);
 #endif
 
-  return __write(proc, destination, offset, data);
+  return val;
 }
 
 
-/*free_pcb_memphy - collect all memphy of pcb
+/*free_pcb_memph - collect all memphy of pcb
  *@caller: caller
- *@vmaid: ID vm area to alloc memory region
- *@incpgnum: number of page
+ *@cpu: CPU the caller finished on, its frames go to that magazine
+ *
+ *  Give back its frames in MEMRAM and MEMSWP and release its mm, once
+ *  it has finished.
  */
-int free_pcb_memph(struct pcb_t *caller)
+int free_pcb_memph(struct pcb_t *caller, int cpu)
 {
-  int pagenum, fpn;
-  uint32_t pte;
+  int pgdit, pteit, fpn;
+  uint32_t *leaf, pte;
+  struct pgn_t *pg;
+  struct vm_area_struct *vma;
+  struct vm_rg_struct *rg;
+
+  /* Only populated leaf tables can hold mapped pages */
+  for(pgdit = 0; pgdit < PAGING_PGD_ENTRIES; pgdit++)
+  {
+    leaf = caller->mm->pgd[pgdit];
+    if (leaf == NULL)
+      continue;
 
+    for(pteit = 0; pteit < PAGING_PTRS_PER_LEAF; pteit++)
+    {
+      pte = leaf[pteit];
 
-  for(pagenum = 0; pagenum < PAGING_MAX_PGN; pagenum++)
-  {
-    pte= caller->mm->pgd[pagenum];
+      if (!PAGING_PTE_PAGE_PRESENT(pte))
+        continue;
+
+      if (PAGING_PTE_PAGE_HUGE(pte))
+      {
+        MEMPHY_free_order(caller->mram, PAGING_PTE_FPN(pte), PAGING_HUGE_ORDER);
+      } else if (!(pte & PAGING_PTE_SWAPPED_MASK))
+      {
+        fpn = PAGING_PTE_FPN(pte);
+        MEMPHY_put_freefp(caller->mram, cpu, fpn);
+      } else {
+        fpn = PAGING_PTE_SWP(pte);
+        MEMPHY_put_freefp(caller->active_mswp, cpu, fpn);
+      }
+    }
+  }
+
+  free_pgd(caller->mm);
 
-    if (!PAGING_PTE_PAGE_PRESENT(pte))
+  /* Then the bookkeeping of the address space itself */
+  while ((pg = caller->mm->fifo_pgn) != NULL)
+  {
+    caller->mm->fifo_pgn = pg->pg_next;
+    free(pg);
+  }
+  while ((vma = caller->mm->mmap) != NULL)
+  {
+    while ((rg = vma->vm_freerg_list) != NULL)
     {
-      fpn = PAGING_PTE_FPN(pte);
-      MEMPHY_put_freefp(caller->mram, fpn);
-    } else {
-      fpn = PAGING_PTE_SWP(pte);
-      MEMPHY_put_freefp(caller->active_mswp, fpn);    
+      vma->vm_freerg_list = rg->rg_next;
+      free(rg);
     }
+    caller->mm->mmap = vma->vm_next;
+    free(vma);
   }
+  free(caller->mm);
+  caller->mm = NULL;
 
   return 0;
 }
@@ -411,15 +528,12 @@ int free_pcb_memph(struct pcb_t *caller)
 struct vm_rg_struct* get_vm_area_node_at_brk(struct pcb_t *caller, int vmaid, int size, int alignedsz)
 {
   struct vm_rg_struct * newrg;
-  /* TODO retrive current vma to obtain newrg, current comment out due to compiler redundant warning*/
-  //struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+  struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
-  newrg = malloc(sizeof(struct vm_rg_struct));
+  if (cur_vma == NULL)
+    return NULL;
 
-  /* TODO: update the newrg boundary
-  // newrg->rg_start = ...
-  // newrg->rg_end = ...
-  */
+  newrg = init_vm_rg(cur_vma->sbrk, cur_vma->sbrk + alignedsz, vmaid);
 
   return newrg;
 }
@@ -433,45 +547,57 @@ struct vm_rg_struct* get_vm_area_node_at_brk(struct pcb_t *caller, int vmaid, in
  */
 int validate_overlap_vm_area(struct pcb_t *caller, int vmaid, int vmastart, int vmaend)
 {
-  //struct vm_area_struct *vma = caller->mm->mmap;
+  struct vm_area_struct *vma = caller->mm->mmap;
 
-  /* TODO validate the planned memory area is not overlapped */
+  if (vmaend > BIT(PAGING_CPU_BUS_WIDTH))
+    return -1; /* Past the end of the address space */
 
+  /* Nor may it run into another vma, even an empty one */
+  for (; vma != NULL; vma = vma->vm_next)
+  {
+    if (vma->vm_id != vmaid &&
+        OVERLAP(vmastart, vmaend, vma->vm_start, vma->vm_end))
+      return -1;
+  }
 
   return 0;
 }
 
 /*inc_vma_limit - increase vm area limits to reserve space for new variable
  *@caller: caller
+ *@cpu: CPU executing the caller
  *@vmaid: ID vm area to alloc memory region
  *@inc_sz: increment size 
  *@inc_limit_ret: increment limit return
  *
+ *  The vma is left untouched if the area cannot be mapped.
  */
-int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int* inc_limit_ret)
+int inc_vma_limit(struct pcb_t *caller, int cpu, int vmaid, int inc_sz, int* inc_limit_ret)
 {
-  struct vm_rg_struct * newrg = malloc(sizeof(struct vm_rg_struct));
+  struct vm_rg_struct newrg;
   int inc_amt = PAGING_PAGE_ALIGNSZ(inc_sz);
   int incnumpage =  inc_amt / PAGING_PAGESZ;
   struct vm_rg_struct *area = get_vm_area_node_at_brk(caller, vmaid, inc_sz, inc_amt);
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
+  int ret = -1;
 
-  int old_end = cur_vma->vm_end;
+  if (area == NULL)
+    return -1;
 
   /*Validate overlap of obtained region */
-  if (validate_overlap_vm_area(caller, vmaid, area->rg_start, area->rg_end) < 0)
-    return -1; /*Overlap and failed allocation */
-
-  /* TODO: Obtain the new vm area based on vmaid */
-  //cur_vma->vm_end... 
-  // inc_limit_ret...
+  if (validate_overlap_vm_area(caller, vmaid, area->rg_start, area->rg_end) == 0 &&
+      vm_map_ram(caller, cpu, area->rg_start, area->rg_end,
+                 cur_vma->sbrk, incnumpage, &newrg) == 0)
+  { /* Mapped to MEMRAM, commit the new limit */
+    cur_vma->vm_end = area->rg_end;
+    cur_vma->sbrk = area->rg_end;
+    *inc_limit_ret = cur_vma->vm_end;
+    ret = 0;
+  }
 
-  if (vm_map_ram(caller, area->rg_start, area->rg_end, 
-                    old_end, incnumpage , newrg) < 0)
-    return -1; /* Map the memory to MEMRAM */
-
-  return 0;
+  free(area);
 
+  return ret;
 }
 
 /*find_victim_page - find victim page
@@ -481,10 +607,31 @@ int inc_vma_limit(struct pcb_t *caller, int vmaid, int inc_sz, int* inc_limit_re
  */
 int find_victim_page(struct mm_struct *mm, int *retpgn) 
 {
-  struct pgn_t *pg = mm->fifo_pgn;
+  struct pgn_t **pp = &mm->fifo_pgn, **victim = NULL, *pg;
+  uint32_t *pte;
 
-  /* TODO: Implement the theorical mechanism to find the victim page */
+  /* FIFO: pages are enlisted at the head, so the victim is the last
+   * page still online. Nodes of pages gone to swap are dropped. */
+  while ((pg = *pp) != NULL)
+  {
+    pte = pte_lookup(mm, pg->pgn);
+    if (pte == NULL || !PAGING_PTE_PAGE_PRESENT(*pte) ||
+        (*pte & PAGING_PTE_SWAPPED_MASK))
+    {
+      *pp = pg->pg_next;
+      free(pg);
+      continue;
+    }
+    victim = pp;
+    pp = &pg->pg_next;
+  }
+
+  if (victim == NULL)
+    return -1;
 
+  pg = *victim;
+  *retpgn = pg->pgn;
+  *victim = pg->pg_next;
   free(pg);
 
   return 0;
@@ -500,6 +647,9 @@ int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_s
 {
   struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, vmaid);
 
+  if (cur_vma == NULL)
+    return -1;
+
   struct vm_rg_struct *rgit = cur_vma->vm_freerg_list;
 
   if (rgit == NULL)
@@ -515,6 +665,7 @@ int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_s
     { /* Current region has enough space */
       newrg->rg_start = rgit->rg_start;
       newrg->rg_end = rgit->rg_start + size;
+      newrg->vmaid = vmaid;
 
       /* Update left space in chosen region */
       if (rgit->rg_start + size < rgit->rg_end)
@@ -542,6 +693,7 @@ int get_free_vmrg_area(struct pcb_t *caller, int vmaid, int size, struct vm_rg_s
           rgit->rg_next = NULL;
         }
       }
+      break;
     }
     else
     {
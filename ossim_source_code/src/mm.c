@@ -7,6 +7,7 @@
 #include "mm.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /* 
  * init_pte - Initialize PTE entry
@@ -53,6 +54,7 @@ int pte_set_swap(uint32_t *pte, int swptyp, int swpoff)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   SETBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_HUGE_MASK);
 
   SETVAL(*pte, swptyp, PAGING_PTE_SWPTYP_MASK, PAGING_PTE_SWPTYP_LOBIT);
   SETVAL(*pte, swpoff, PAGING_PTE_SWPOFF_MASK, PAGING_PTE_SWPOFF_LOBIT);
@@ -69,12 +71,123 @@ int pte_set_fpn(uint32_t *pte, int fpn)
 {
   SETBIT(*pte, PAGING_PTE_PRESENT_MASK);
   CLRBIT(*pte, PAGING_PTE_SWAPPED_MASK);
+  CLRBIT(*pte, PAGING_PTE_HUGE_MASK);
 
   SETVAL(*pte, fpn, PAGING_PTE_FPN_MASK, PAGING_PTE_FPN_LOBIT); 
 
   return 0;
 }
 
+/* 
+ * pte_set_huge - Set PTE entry for on-line huge page
+ * @pte   : PTE of the first page of the huge page
+ * @fpn   : first of its PAGING_HUGE_NR contiguous frames
+ */
+int pte_set_huge(uint32_t *pte, int fpn)
+{
+  pte_set_fpn(pte, fpn);
+  SETBIT(*pte, PAGING_PTE_HUGE_MASK);
+
+  return 0;
+}
+
+/*
+ * pte_demote - split a huge page back to base pages
+ * @mm  : owner mm
+ * @pgn : any page number inside the huge page
+ *
+ * The frames stay where they are, every base page gets its own PTE
+ * so they can be swapped out one by one. Their FIFO nodes are there
+ * since the huge page was mapped, and their translations are the same.
+ */
+int pte_demote(struct mm_struct *mm, int pgn)
+{
+  uint32_t *head = pte_lookup(mm, pgn);
+  int fpn, pgit;
+
+  if (head == NULL || !PAGING_PTE_PAGE_HUGE(*head))
+    return -1;
+
+  fpn = PAGING_PTE_FPN(*head);
+  pte_set_fpn(head, fpn);
+  for (pgit = 1; pgit < PAGING_HUGE_NR; pgit++)
+    pte_set_fpn(head + pgit, fpn + pgit);
+
+  return 0;
+}
+
+
+/*
+ * pte_lookup - find the PTE of a page
+ * @mm  : owner mm
+ * @pgn : page number
+ *
+ * Inside a huge page this is the PTE of its first page.
+ * Return NULL if no page of its leaf table was ever mapped.
+ */
+uint32_t *pte_lookup(struct mm_struct *mm, int pgn)
+{
+  uint32_t *leaf, *head;
+
+  if (pgn < 0 || pgn >= PAGING_MAX_PGN)
+    return NULL;
+
+  leaf = mm->pgd[PAGING_PGD_IDX(pgn)];
+  if (leaf == NULL)
+    return NULL;
+
+  /* Huge pages are aligned, so they never straddle two leaves */
+  head = &leaf[PAGING_LEAF_IDX(pgn) - PAGING_HUGE_IDX(pgn)];
+  if (PAGING_PTE_PAGE_HUGE(*head))
+    return head;
+
+  return &leaf[PAGING_LEAF_IDX(pgn)];
+}
+
+/*
+ * pte_alloc - find the PTE of a page, populating its leaf table
+ * @mm  : owner mm
+ * @pgn : page number
+ */
+uint32_t *pte_alloc(struct mm_struct *mm, int pgn)
+{
+  uint32_t **slot;
+
+  if (pgn < 0 || pgn >= PAGING_MAX_PGN)
+    return NULL;
+
+  slot = &mm->pgd[PAGING_PGD_IDX(pgn)];
+  if (*slot == NULL) {
+    *slot = calloc(PAGING_PTRS_PER_LEAF, sizeof(uint32_t));
+    if (*slot == NULL)
+      return NULL;
+  }
+
+  return &(*slot)[PAGING_LEAF_IDX(pgn)];
+}
+
+/*
+ * free_pgd - release the leaf tables and the directory of a mm
+ * @mm : owner mm
+ */
+int free_pgd(struct mm_struct *mm)
+{
+  int pgdit;
+
+  tlb_flush_mm(mm);
+
+  for (pgdit = 0; pgdit < PAGING_PGD_ENTRIES; pgdit++)
+  {
+    if (mm->pgd[pgdit] == NULL)
+      continue;
+
+    free(mm->pgd[pgdit]);
+  }
+  free(mm->pgd);
+  mm->pgd = NULL;
+
+  return 0;
+}
 
 /* 
  * vmap_page_range - map a range of page at aligned address
@@ -85,28 +198,45 @@ int vmap_page_range(struct pcb_t *caller, // process call
            struct framephy_struct *frames,// list of the mapped frames
               struct vm_rg_struct *ret_rg)// return mapped region, the real mapped fp
 {                                         // no guarantee all given pages are mapped
-  //uint32_t * pte = malloc(sizeof(uint32_t));
-  struct framephy_struct *fpit = malloc(sizeof(struct framephy_struct));
-  //int  fpn;
-  int pgit = 0;
+  struct framephy_struct *fpit;
+  uint32_t *pte;
+  int pgit = 0, frit, nr, pgend;
   int pgn = PAGING_PGN(addr);
 
-  /* TODO: update the rg_end and rg_start of ret_rg 
-  //ret_rg->rg_end =  ....
-  //ret_rg->rg_start = ...
-  //ret_rg->vmaid = ...
-  */
-
-  fpit->fp_next = frames;
-
-  /* TODO map range of frame to address space 
-   *      in page table pgd in caller->mm
-   */
+  /* The vmaid of ret_rg is left to the caller, which knows the vma */
+  ret_rg->rg_start = addr;
 
-   /* Tracking for later page replacement activities (if needed)
-    * Enqueue new usage page */
-   enlist_pgn_node(&caller->mm->fifo_pgn, pgn+pgit);
+  /* Map range of frame to address space in page table pgd in caller->mm */
+  for (fpit = frames; fpit != NULL && pgit < pgnum; fpit = fpit->fp_next)
+  {
+    for (frit = 0; frit < fpit->fp_nr && pgit < pgnum; frit += nr)
+    {
+      pte = pte_alloc(caller->mm, pgn + pgit);
+      if (pte == NULL)
+        break; /* out of memory for the leaf table */
+
+#ifdef MM_HUGEPAGE
+      if (fpit->fp_nr - frit >= PAGING_HUGE_NR && pgnum - pgit >= PAGING_HUGE_NR &&
+          PAGING_HUGE_IDX(pgn + pgit) == 0 && PAGING_HUGE_IDX(fpit->fpn + frit) == 0)
+      { /* Aligned contiguous frames, one PTE covers them all */
+        pte_set_huge(pte, fpit->fpn + frit);
+        nr = PAGING_HUGE_NR;
+      } else
+#endif
+      { /* Misaligned chunks fall back to base pages over the same frames */
+        pte_set_fpn(pte, fpit->fpn + frit);
+        nr = 1;
+      }
+
+      /* Tracking for later page replacement activities (if needed)
+       * Enqueue new usage page, every page of a huge one: it is split
+       * when one of them is picked as a victim */
+      for (pgend = pgit + nr; pgit < pgend; pgit++)
+        enlist_pgn_node(&caller->mm->fifo_pgn, pgn + pgit);
+    }
+  }
 
+  ret_rg->rg_end = addr + pgit * PAGING_PAGESZ;
 
   return 0;
 }
@@ -114,28 +244,65 @@ int vmap_page_range(struct pcb_t *caller, // process call
 /* 
  * alloc_pages_range - allocate req_pgnum of frame in ram
  * @caller    : caller
+ * @cpu       : CPU executing the caller, whose magazine is used
  * @req_pgnum : request page num
  * @frm_lst   : frame list
+ *
+ * Frames cached in the magazines of the other CPUs are drained back
+ * once, then pages of the caller are swapped out to MEMSWP before
+ * giving up.
  */
 
-int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struct** frm_lst)
+int alloc_pages_range(struct pcb_t *caller, int cpu, int req_pgnum, struct framephy_struct** frm_lst)
 {
-  int pgit, fpn;
-  //struct framephy_struct *newfp_str;
+  int pgit, fpn, nr, order, drained = 0;
+  struct framephy_struct *newfp_str, **tail = frm_lst;
 
-
-  /* TODO: allocate the page 
-  //caller-> ...
-  //frm_lst-> ...
-  */
-  for(pgit = 0; pgit < req_pgnum; pgit++)
+  *frm_lst = NULL;
+  for(pgit = 0; pgit < req_pgnum; pgit += nr)
   {
-    if(MEMPHY_get_freefp(caller->mram, &fpn) == 0)
-   {
-     
-   } else {  // ERROR CODE of obtaining somes but not enough frames
-   } 
- }
+    /* Largest buddy block available that does not overshoot */
+    order = MEMPHY_MAX_ORDER;
+    while (BIT(order) > req_pgnum - pgit)
+      order--;
+    while (order > 0 && MEMPHY_alloc_order(caller->mram, order, &fpn) != 0)
+      order--;
+    if (order == 0 && MEMPHY_get_freefp(caller->mram, cpu, &fpn) != 0)
+      order--;
+
+    if (order < 0 && !drained)
+    { /* Retry with the frames parked in every magazine */
+      MEMPHY_drain_mags(caller->mram);
+      drained = 1;
+      nr = 0;
+      continue;
+    }
+    if (order < 0 && swap_out_page(caller->mm, caller, cpu, &fpn) == 0)
+      order = 0;
+
+    if (order < 0)
+    { // ERROR CODE of obtaining somes but not enough frames
+      while ((newfp_str = *frm_lst) != NULL)
+      { /* Single frames go back the way they came, through the magazine */
+        if (newfp_str->fp_nr == 1)
+          MEMPHY_put_freefp(caller->mram, cpu, newfp_str->fpn);
+        else
+          MEMPHY_free_order(caller->mram, newfp_str->fpn, NBITS(newfp_str->fp_nr));
+        *frm_lst = newfp_str->fp_next;
+        free(newfp_str);
+      }
+      return -3000;
+    }
+    nr = BIT(order);
+
+    newfp_str = malloc(sizeof(struct framephy_struct));
+    newfp_str->fpn = fpn;
+    newfp_str->fp_nr = nr;
+    newfp_str->fp_next = NULL;
+    newfp_str->owner = caller->mm;
+    *tail = newfp_str;
+    tail = &newfp_str->fp_next;
+  }
 
   return 0;
 }
@@ -144,13 +311,14 @@ int alloc_pages_range(struct pcb_t *caller, int req_pgnum, struct framephy_struc
 /* 
  * vm_map_ram - do the mapping all vm are to ram storage device
  * @caller    : caller
+ * @cpu       : CPU executing the caller
  * @astart    : vm area start
  * @aend      : vm area end
  * @mapstart  : start mapping point
  * @incpgnum  : number of mapped page
  * @ret_rg    : returned region
  */
-int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg)
+int vm_map_ram(struct pcb_t *caller, int cpu, int astart, int aend, int mapstart, int incpgnum, struct vm_rg_struct *ret_rg)
 {
   struct framephy_struct *frm_lst = NULL;
   int ret_alloc;
@@ -162,7 +330,7 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
    *in endless procedure of swap-off to get frame and we have not provide 
    *duplicate control mechanism, keep it simple
    */
-  ret_alloc = alloc_pages_range(caller, incpgnum, &frm_lst);
+  ret_alloc = alloc_pages_range(caller, cpu, incpgnum, &frm_lst);
 
   if (ret_alloc < 0 && ret_alloc != -3000)
     return -1;
@@ -180,6 +348,14 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
    * do the swaping all to swapper to get the all in ram */
   vmap_page_range(caller, mapstart, incpgnum, frm_lst, ret_rg);
 
+  /* The page table owns the frames now */
+  while (frm_lst != NULL)
+  {
+    struct framephy_struct *fp = frm_lst;
+    frm_lst = fp->fp_next;
+    free(fp);
+  }
+
   return 0;
 }
 
@@ -192,19 +368,12 @@ int vm_map_ram(struct pcb_t *caller, int astart, int aend, int mapstart, int inc
 int __swap_cp_page(struct memphy_struct *mpsrc, int srcfpn,
                 struct memphy_struct *mpdst, int dstfpn) 
 {
-  int cellidx;
-  int addrsrc,addrdst;
-  for(cellidx = 0; cellidx < PAGING_PAGESZ; cellidx++)
-  {
-    addrsrc = srcfpn * PAGING_PAGESZ + cellidx;
-    addrdst = dstfpn * PAGING_PAGESZ + cellidx;
+  BYTE data[PAGING_PAGESZ];
 
-    BYTE data;
-    MEMPHY_read(mpsrc, addrsrc, &data);
-    MEMPHY_write(mpdst, addrdst, data);
-  }
+  if (MEMPHY_read_frame(mpsrc, srcfpn, data) != 0)
+    return -1;
 
-  return 0;
+  return MEMPHY_write_frame(mpdst, dstfpn, data);
 }
 
 /*
@@ -217,34 +386,35 @@ int init_mm(struct mm_struct *mm, struct pcb_t *caller)
   struct vm_area_struct * vma0 = malloc(sizeof(struct vm_area_struct));
   struct vm_area_struct * vma1 = malloc(sizeof(struct vm_area_struct));
 
-  mm->pgd = malloc(PAGING_MAX_PGN*sizeof(uint32_t));
+  mm->pgd = calloc(PAGING_PGD_ENTRIES, sizeof(uint32_t *));
+  memset(mm->symrgtbl, 0, sizeof(mm->symrgtbl));
+  mm->fifo_pgn = NULL;
 
   /* By default the owner comes with at least one vma for DATA */
   vma0->vm_id = 0;
   vma0->vm_start = 0;
   vma0->vm_end = vma0->vm_start;
   vma0->sbrk = vma0->vm_start;
+  vma0->vm_freerg_list = NULL;
   struct vm_rg_struct *first_rg = init_vm_rg(vma0->vm_start, vma0->vm_end, 0);
   enlist_vm_rg_node(&vma0->vm_freerg_list, first_rg);
-
-  /* TODO update VMA0 next */
-  // vma0->next = ...
-
-  /* TODO: update one vma for HEAP */
-  // vma1->vm_id = ...
-  // vma1->vm_start = ...
-  // vma1->vm_end = ...
-  // vma1->sbrk = ...
-  // enlist_vm_rg_node(&vma1...)
-  // vma1->vm_next
-  // enlist_vm_rg_node(&vma1->vm_freerg_list,...)
+  vma0->vm_next = vma1;
+
+  /* and one for HEAP */
+  vma1->vm_id = 1;
+  vma1->vm_start = PAGING_HEAP_START;
+  vma1->vm_end = vma1->vm_start;
+  vma1->sbrk = vma1->vm_start;
+  vma1->vm_freerg_list = NULL;
+  first_rg = init_vm_rg(vma1->vm_start, vma1->vm_end, 1);
+  enlist_vm_rg_node(&vma1->vm_freerg_list, first_rg);
+  vma1->vm_next = NULL;
 
   /* Point vma owner backward */
   vma0->vm_mm = mm; 
   vma1->vm_mm = mm;
 
-  /* TODO: update mmap */
-  //mm->mmap = ...
+  mm->mmap = vma0;
 
   return 0;
 }
@@ -347,22 +517,31 @@ int print_pgtbl(struct pcb_t *caller, uint32_t start, uint32_t end)
   int pgn_start,pgn_end;
   int pgit;
 
+  if (caller == NULL) {printf("NULL caller\n"); return -1;}
+
   if(end == -1){
     pgn_start = 0;
     struct vm_area_struct *cur_vma = get_vma_by_num(caller->mm, 0);
-    end = cur_vma->vm_end;
+    end = cur_vma != NULL ? cur_vma->vm_end : 0;
   }
   pgn_start = PAGING_PGN(start);
   pgn_end = PAGING_PGN(end);
 
   printf("print_pgtbl: %d - %d", start, end);
-  if (caller == NULL) {printf("NULL caller\n"); return -1;}
     printf("\n");
 
 
   for(pgit = pgn_start; pgit < pgn_end; pgit++)
   {
-     printf("%08ld: %08x\n", pgit * sizeof(uint32_t), caller->mm->pgd[pgit]);
+     uint32_t *pte = pte_lookup(caller->mm, pgit);
+
+     if (pte == NULL) { /* Skip the rest of an unpopulated leaf */
+       pgit |= PAGING_PTRS_PER_LEAF - 1;
+       continue;
+     }
+     if (PAGING_PTE_PAGE_HUGE(*pte) && PAGING_HUGE_IDX(pgit) != 0)
+       continue; /* Mapped by the huge PTE already printed */
+     printf("%08ld: %08x\n", pgit * sizeof(uint32_t), *pte);
   }
 
   return 0;
@@ -12,9 +12,19 @@
 
 static int time_slot;
 static int num_cpus;
+static int sched_policy = SCHED_POLICY_MLQ;
+static int mlfq_nr_bands;
+static int mlfq_quanta[MLFQ_MAX_BANDS];
 static int done = 0;
+static int nr_cpus_stopped = 0;
 
 #ifdef MM_PAGING
+static int swap_latency = PAGING_SWAP_LATENCY;
+#ifdef MM_SWP_SEQUENTIAL
+static int swap_sequential = 1;
+#else
+static int swap_sequential = 0;
+#endif
 static int memramsz;
 static int memswpsz[PAGING_MAX_MMSWP];
 #ifdef MM_PAGING_HEAP_GODOWN
@@ -36,6 +46,8 @@ static struct ld_args{
 	unsigned long * start_time;
 #ifdef MLQ_SCHED
 	unsigned long * prio;
+	unsigned long * deadline;	// Relative deadline, 0 if none
+	unsigned long * wcet;
 #endif
 } ld_processes;
 int num_processes;
@@ -57,49 +69,85 @@ static void * cpu_routine(void * args) {
 		if (proc == NULL) {
 			/* No process is running, the we load new process from
 		 	* ready queue */
-			proc = get_proc();
-			if (proc == NULL) {
-                           next_slot(timer_id);
-                           continue; /* First load failed. skip dummy load */
-                        }
+			proc = get_proc(id);
 		}else if (proc->pc == proc->code->size) {
 			/* The porcess has finish it job */
 			printf("\tCPU %d: Processed %2d has finished\n",
 				id ,proc->pid);
+			finish_proc(proc);
+#ifdef MM_PAGING
+			free_pcb_memph(proc, id);
+#endif
 			free(proc);
-			proc = get_proc();
+			proc = get_proc(id);
 			time_left = 0;
-		}else if (time_left == 0) {
-			/* The process has done its job in current time slot */
+		}else if (time_left == 0 || need_resched(id)) {
+			/* The process has done its job in current time slot,
+			 * or a more urgent process has arrived */
+			if (time_left > 0) {
+				printf("\tCPU %d: Preempted process %2d\n",
+					id, proc->pid);
+				preempt_proc(proc, time_left);
+				time_left = 0;
+			}
 			printf("\tCPU %d: Put process %2d to run queue\n",
 				id, proc->pid);
-			put_proc(proc);
-			proc = get_proc();
+			put_proc(proc, id);
+			proc = get_proc(id);
 		}
 		
 		/* Recheck process status after loading new process */
-		if (proc == NULL && done) {
-			/* No process to run, exit */
+		if (proc == NULL && done && !procs_blocked() &&
+				(proc = get_proc(id)) == NULL) {
+			/* No process to run nor to wake up, exit. The last
+			 * look covers one woken up since the first */
 			printf("\tCPU %d stopped\n", id);
 			break;
 		}else if (proc == NULL) {
 			/* There may be new processes to run in
-			 * next time slots, just skip current slot */
-			next_slot(timer_id);
+			 * next time slots, sleep until one is added */
+			if (!park_cpu(id)) {
+				idle_slot(timer_id, TIMER_NEVER);
+			}
 			continue;
 		}else if (time_left == 0) {
 			printf("\tCPU %d: Dispatched process %2d\n",
 				id, proc->pid);
-			time_left = time_slot;
+			time_left = get_quantum(proc, time_slot);
 		}
 		
-		/* Run current process */
-		run(proc);
-		time_left--;
-		next_slot(timer_id);
+		/* Run current process: a stretch of CALC is retired at once
+		 * and the slots it stands for pass in one step */
+		uint32_t ran = run_n(proc, id, time_left);
+#ifdef MM_PAGING
+		if (proc->swap_pgn >= 0) {
+			/* Faulted on a swapped page: run something else while
+			 * the swap daemon brings it in */
+			printf("\tCPU %d: Process %2d blocked on swap-in\n",
+				id, proc->pid);
+			block_proc(proc);
+			swapd_submit(proc);
+			proc = NULL;
+			time_left = 0;
+			continue;
+		}
+#endif
+		uint32_t passed = next_slots(timer_id, ran);
+		if (passed < ran) {
+			/* Woken up early, e.g. to be preempted: take back the
+			 * CALC of the slots that did not pass yet */
+			proc->pc -= ran - passed;
+		}
+		time_left -= passed;
 	}
+#ifdef MM_PAGING
+	if (__atomic_add_fetch(&nr_cpus_stopped, 1, __ATOMIC_SEQ_CST) ==
+			num_cpus) {
+		swapd_stop();
+	}
+#endif
 	detach_event(timer_id);
-	pthread_exit(NULL);
+	return NULL;
 }
 
 static void * ld_routine(void * args) {
@@ -116,10 +164,17 @@ static void * ld_routine(void * args) {
 	while (i < num_processes) {
 		struct pcb_t * proc = load(ld_processes.path[i]);
 #ifdef MLQ_SCHED
-		proc->prio = ld_processes.prio[i];
+		/* Priority of the config line, or of the process file */
+		proc->prio = ld_processes.prio[i] < MAX_PRIO ?
+			ld_processes.prio[i] : proc->priority;
+		if (proc->prio >= MAX_PRIO) {
+			proc->prio = MAX_PRIO - 1;
+		}
+		proc->deadline = ld_processes.deadline[i];
+		proc->wcet = ld_processes.wcet[i];
 #endif
 		while (current_time() < ld_processes.start_time[i]) {
-			next_slot(timer_id);
+			idle_slot(timer_id, ld_processes.start_time[i]);
 		}
 #ifdef MM_PAGING
 		proc->mm = malloc(sizeof(struct mm_struct));
@@ -131,8 +186,13 @@ static void * ld_routine(void * args) {
 		proc->mswp = mswp;
 		proc->active_mswp = active_mswp;
 #endif
-		printf("\tLoaded a process at %s, PID: %d PRIO: %ld\n",
-			ld_processes.path[i], proc->pid, ld_processes.prio[i]);
+#ifdef MLQ_SCHED
+		printf("\tLoaded a process at %s, PID: %d PRIO: %u\n",
+			ld_processes.path[i], proc->pid, proc->prio);
+#else
+		printf("\tLoaded a process at %s, PID: %d PRIO: %u\n",
+			ld_processes.path[i], proc->pid, proc->priority);
+#endif
 		add_proc(proc);
 		free(ld_processes.path[i]);
 		i++;
@@ -140,9 +200,14 @@ static void * ld_routine(void * args) {
 	}
 	free(ld_processes.path);
 	free(ld_processes.start_time);
+#ifdef MLQ_SCHED
+	free(ld_processes.deadline);
+	free(ld_processes.wcet);
+#endif
 	done = 1;
+	end_of_arrivals();
 	detach_event(timer_id);
-	pthread_exit(NULL);
+	return NULL;
 }
 
 static void read_config(const char * path) {
@@ -151,64 +216,152 @@ static void read_config(const char * path) {
 		printf("Cannot find configure file at %s\n", path);
 		exit(1);
 	}
-	fscanf(file, "%d %d %d\n", &time_slot, &num_cpus, &num_processes);
+	/* [time slice] [N = Number of CPU] [M = Number of Processes to be run]
+	 * [scheduling policy (optional): mlq (default), cfs or mlfq]
+	 * [quantum of each MLFQ band, most urgent first (optional)] */
+	char line[256], policy[16];
+	int len = 0;
+	policy[0] = '\0';
+	fgets(line, sizeof(line), file);
+	sscanf(line, "%d %d %d %15s%n", &time_slot, &num_cpus, &num_processes,
+		policy, &len);
+	if (policy[0] != '\0' &&
+			(sched_policy = sched_policy_by_name(policy)) < 0) {
+		printf("Unknown scheduling policy %s\n", policy);
+		exit(1);
+	}
+	if (sched_policy == SCHED_POLICY_MLFQ) {
+		char * quantum = line + len, * end;
+		for (mlfq_nr_bands = 0; mlfq_nr_bands < MLFQ_MAX_BANDS;
+				mlfq_nr_bands++, quantum = end) {
+			mlfq_quanta[mlfq_nr_bands] = strtol(quantum, &end, 10);
+			if (end == quantum)
+				break;
+			if (mlfq_quanta[mlfq_nr_bands] <= 0) {
+				printf("Invalid MLFQ quantum\n");
+				exit(1);
+			}
+		}
+		if (mlfq_nr_bands == 0) {
+			/* Default: 4 bands, doubling the time slice each band */
+			for (; mlfq_nr_bands < 4; mlfq_nr_bands++)
+				mlfq_quanta[mlfq_nr_bands] =
+					time_slot << mlfq_nr_bands;
+		}
+	}
 	ld_processes.path = (char**)malloc(sizeof(char*) * num_processes);
 	ld_processes.start_time = (unsigned long*)
 		malloc(sizeof(unsigned long) * num_processes);
 #ifdef MM_PAGING
 	int sit;
-#ifdef MM_FIXED_MEMSZ
 	/* We provide here a back compatible with legacy OS simulatiom config file
-         * In which, it have no addition config line for Mema, keep only one line
+	 * In which, it have no addition config line for Mema, keep only one line
 	 * for legacy info 
-         *  [time slice] [N = Number of CPU] [M = Number of Processes to be run]
-         */
-        memramsz    =  0x100000;
-        memswpsz[0] = 0x1000000;
+	 *  [time slice] [N = Number of CPU] [M = Number of Processes to be run]
+	 */
+	memramsz    =  0x100000;
+	memswpsz[0] = 0x1000000;
 	for(sit = 1; sit < PAGING_MAX_MMSWP; sit++)
 		memswpsz[sit] = 0;
 #ifdef MM_PAGING_HEAP_GODOWN
-	vmemsz = 0x300000
+	vmemsz = 0x300000;
 #endif
-#else
+#endif
+	line[0] = '\0';
+#if defined(MM_PAGING) && !defined(MM_FIXED_MEMSZ)
 	/* Read input config of memory size: MEMRAM and upto 4 MEMSWP (mem swap)
 	 * Format: (size=0 result non-used memswap, must have RAM and at least 1 SWAP)
 	 *        MEM_RAM_SZ MEM_SWP0_SZ MEM_SWP1_SZ MEM_SWP2_SZ MEM_SWP3_SZ
-	*/
-	fscanf(file, "%d\n", &memramsz);
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
-		fscanf(file, "%d", &(memswpsz[sit])); 
-#ifdef MM_PAGIMG_HEAP_GODOWN
-	fscanf(file, "%d\n", &vmemsz);
-#endif
-
-       fscanf(file, "\n"); /* Final character */
+	 * A config without this line keeps the legacy sizes above: its
+	 * second line already describes a process.
+	 */
+	int memsz[PAGING_MAX_MMSWP + 1] = {0};
+	if (fgets(line, sizeof(line), file) != NULL &&
+			sscanf(line, "%d %d %d %d %d", &memsz[0], &memsz[1],
+				&memsz[2], &memsz[3], &memsz[4]) >= 2) {
+		memramsz = memsz[0];
+		for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+			memswpsz[sit] = memsz[sit + 1];
+#ifdef MM_PAGING_HEAP_GODOWN
+		sscanf(line, "%*d %*d %*d %*d %*d %d", &vmemsz);
 #endif
+		line[0] = '\0';
+	}
 #endif
 
 #ifdef MLQ_SCHED
 	ld_processes.prio = (unsigned long*)
 		malloc(sizeof(unsigned long) * num_processes);
+	ld_processes.deadline = (unsigned long*)
+		calloc(num_processes, sizeof(unsigned long));
+	ld_processes.wcet = (unsigned long*)
+		calloc(num_processes, sizeof(unsigned long));
 #endif
-	int i;
-	for (i = 0; i < num_processes; i++) {
-		ld_processes.path[i] = (char*)malloc(sizeof(char) * 100);
-		ld_processes.path[i][0] = '\0';
-		strcat(ld_processes.path[i], "input/proc/");
-		char proc[100];
+	/* [arrival time] [process] [priority (optional, MLQ)]
+	 * [deadline relative to arrival] [WCET] (optional, EDF)
+	 * Blank lines are skipped. A config listing fewer processes than it
+	 * announces runs the ones it lists. */
+	int i = 0;
+	char proc[100];
+	while (i < num_processes &&
+			(line[0] != '\0' || fgets(line, sizeof(line), file) != NULL)) {
+		len = 0;
+		if (sscanf(line, "%lu %99s%n", &ld_processes.start_time[i],
+				proc, &len) == 2) {
+			ld_processes.path[i] = (char*)
+				malloc(sizeof("input/proc/") + strlen(proc));
+			strcpy(ld_processes.path[i], "input/proc/");
+			strcat(ld_processes.path[i], proc);
 #ifdef MLQ_SCHED
-		fscanf(file, "%lu %s %lu\n", &ld_processes.start_time[i], proc, &ld_processes.prio[i]);
-#else
-		fscanf(file, "%lu %s\n", &ld_processes.start_time[i], proc);
+			/* MAX_PRIO: take the priority of the process file */
+			ld_processes.prio[i] = MAX_PRIO;
+			if (sscanf(line + len, "%lu", &ld_processes.prio[i]) == 1 &&
+					ld_processes.prio[i] >= MAX_PRIO) {
+				ld_processes.prio[i] = MAX_PRIO - 1;
+			}
+			sscanf(line + len, "%*u %lu %lu", &ld_processes.deadline[i],
+				&ld_processes.wcet[i]);
 #endif
-		strcat(ld_processes.path[i], proc);
+			i++;
+		}
+		line[0] = '\0';
 	}
+	num_processes = i;
+	fclose(file);
 }
 
 int main(int argc, char * argv[]) {
+	/* Run every device as a coroutine on this thread (--coop) */
+	int coop = 0;
+	/* Also write the end-of-run report as CSV (--csv file) */
+	const char * csv = NULL;
+	while (argc > 2) {
+		if (!strcmp(argv[1], "--coop")) {
+			coop = 1;
+		}else if (!strcmp(argv[1], "--csv") && argc > 3) {
+			csv = argv[2];
+			argc--;
+			argv++;
+#ifdef MM_PAGING
+		}else if (!strcmp(argv[1], "--swap-latency") && argc > 3) {
+			/* Slots a page takes to be swapped in */
+			swap_latency = atoi(argv[2]);
+			argc--;
+			argv++;
+		}else if (!strcmp(argv[1], "--seq-swap")) {
+			/* MEMSWP are sequential devices, see MM_SWP_SEQUENTIAL */
+			swap_sequential = 1;
+#endif
+		}else{
+			break;
+		}
+		argc--;
+		argv++;
+	}
 	/* Read config */
 	if (argc != 2) {
-		printf("Usage: os [path to configure file]\n");
+		printf("Usage: os [--coop] [--csv file] [--swap-latency slots] "
+			"[--seq-swap] [path to configure file]\n");
 		return 1;
 	}
 	char path[100];
@@ -229,6 +382,10 @@ int main(int argc, char * argv[]) {
 		args[i].id = i;
 	}
 	struct timer_id_t * ld_event = attach_event();
+#ifdef MM_PAGING
+	struct timer_id_t * swapd_event = attach_event();
+	pthread_t swapd;
+#endif
 	start_timer();
 
 #ifdef MM_PAGING
@@ -240,11 +397,17 @@ int main(int argc, char * argv[]) {
 
 	/* Create MEM RAM */
 	init_memphy(&mram, memramsz, rdmflag);
+	MEMPHY_init_mags(&mram, num_cpus);
 
         /* Create all MEM SWAP */ 
 	int sit;
-	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++)
+	if (swap_sequential) {
+		rdmflag = 0;
+	}
+	for(sit = 0; sit < PAGING_MAX_MMSWP; sit++) {
 	       init_memphy(&mswp[sit], memswpsz[sit], rdmflag);
+	       MEMPHY_init_mags(&mswp[sit], num_cpus);
+	}
 
 	/* In Paging mode, it needs passing the system mem to each PCB through loader*/
 	struct mmpaging_ld_args *mm_ld_args = malloc(sizeof(struct mmpaging_ld_args));
@@ -256,32 +419,69 @@ int main(int argc, char * argv[]) {
 	mm_ld_args->vmemsz = vmemsz;
 #endif
 	mm_ld_args->active_mswp = (struct memphy_struct *) &mswp[0];
+
+	init_tlb(num_cpus);
+	init_swapd(swapd_event, swap_latency);
 #endif
 
 
 	/* Init scheduler */
-	init_scheduler();
+	init_scheduler(num_cpus, sched_policy);
+	if (sched_policy == SCHED_POLICY_MLFQ) {
+		init_mlfq(mlfq_nr_bands, mlfq_quanta);
+	}
+	for (i = 0; i < num_cpus; i++) {
+		attach_cpu(i, args[i].timer_id);
+	}
 
-	/* Run CPU and loader */
 #ifdef MM_PAGING
-	pthread_create(&ld, NULL, ld_routine, (void*)mm_ld_args);
+	void * ld_arg = (void*)mm_ld_args;
 #else
-	pthread_create(&ld, NULL, ld_routine, (void*)ld_event);
+	void * ld_arg = (void*)ld_event;
 #endif
-	for (i = 0; i < num_cpus; i++) {
-		pthread_create(&cpu[i], NULL,
-			cpu_routine, (void*)&args[i]);
-	}
+	if (coop) {
+		/* Step CPUs then loader in a fixed order every slot */
+		for (i = 0; i < num_cpus; i++) {
+			timer_coop_spawn(args[i].timer_id,
+				cpu_routine, (void*)&args[i]);
+		}
+		timer_coop_spawn(ld_event, ld_routine, ld_arg);
+#ifdef MM_PAGING
+		timer_coop_spawn(swapd_event, swapd_routine,
+			(void*)swapd_event);
+#endif
+		timer_coop_run();
+	}else{
+		/* Run CPU and loader */
+		pthread_create(&ld, NULL, ld_routine, ld_arg);
+#ifdef MM_PAGING
+		pthread_create(&swapd, NULL, swapd_routine,
+			(void*)swapd_event);
+#endif
+		for (i = 0; i < num_cpus; i++) {
+			pthread_create(&cpu[i], NULL,
+				cpu_routine, (void*)&args[i]);
+		}
 
-	/* Wait for CPU and loader finishing */
-	for (i = 0; i < num_cpus; i++) {
-		pthread_join(cpu[i], NULL);
+		/* Wait for CPU and loader finishing */
+		for (i = 0; i < num_cpus; i++) {
+			pthread_join(cpu[i], NULL);
+		}
+		pthread_join(ld, NULL);
+#ifdef MM_PAGING
+		pthread_join(swapd, NULL);
+#endif
 	}
-	pthread_join(ld, NULL);
 
 	/* Stop timer */
 	stop_timer();
 
+	finish_scheduler(csv);
+#ifdef MM_PAGING
+	tlb_dump();
+	MEMPHY_frag_dump(&mram);
+#endif
+
 	return 0;
 
 }
@@ -2,19 +2,449 @@
 #include <stdlib.h>
 #include "queue.h"
 
+#define SEG_CLOSED (1UL << (sizeof(unsigned long) * 8 - 1))
+
+static void seg_push_free(struct queue_seg_t * _Atomic * stack,
+                struct queue_seg_t * seg) {
+        seg->free_next = atomic_load(stack);
+        while (!atomic_compare_exchange_weak(stack, &seg->free_next, seg));
+}
+
+static struct queue_seg_t * seg_alloc(struct queue_t * q) {
+        /* Take the whole spare stack, so no one else pops concurrently */
+        struct queue_seg_t * seg = atomic_exchange(&q->spare, NULL);
+        unsigned long i;
+
+        if (seg != NULL) {
+                struct queue_seg_t * rest = seg->free_next;
+                while (rest != NULL) {
+                        struct queue_seg_t * next = rest->free_next;
+                        seg_push_free(&q->spare, rest);
+                        rest = next;
+                }
+        } else {
+                seg = malloc(sizeof(struct queue_seg_t));
+                /* Remember it for free_queue */
+                seg->all_next = atomic_load(&q->segs);
+                while (!atomic_compare_exchange_weak(&q->segs,
+                                &seg->all_next, seg));
+        }
+        for (i = 0; i < QUEUE_SEG_SIZE; i++)
+                atomic_init(&seg->cell[i].seq, i);
+        atomic_init(&seg->head, 0);
+        atomic_init(&seg->tail, 0);
+        atomic_init(&seg->next, NULL);
+        return seg;
+}
+
+/* Segments are retired once head and tail have moved past them, but an
+ * operation that loaded them before may still be at work on them. Any
+ * operation running when the caller (one of them) finds itself alone
+ * started after the retirement, so the retired segments can be reused */
+static void seg_recycle(struct queue_t * q) {
+        struct queue_seg_t * seg = atomic_exchange(&q->retired, NULL);
+        int alone = atomic_load(&q->users) == 1;
+
+        while (seg != NULL) {
+                struct queue_seg_t * next = seg->free_next;
+                seg_push_free(alone ? &q->spare : &q->retired, seg);
+                seg = next;
+        }
+}
+
+/* Return the tail segment, creating the first one on first use */
+static struct queue_seg_t * tail_seg(struct queue_t * q) {
+        struct queue_seg_t * seg = atomic_load(&q->tail);
+        struct queue_seg_t * none = NULL;
+
+        if (seg != NULL)
+                return seg;
+        seg = seg_alloc(q);
+        if (atomic_compare_exchange_strong(&q->head, &none, seg)) {
+                atomic_store(&q->tail, seg);
+                return seg;
+        }
+        seg_push_free(&q->spare, seg);
+        /* Someone else created it: keep ours for the next one */
+        while ((seg = atomic_load(&q->tail)) == NULL);
+        return seg;
+}
+
+static int seg_push(struct queue_seg_t * seg, struct pcb_t * proc) {
+        unsigned long pos = atomic_load(&seg->tail);
+        struct queue_cell_t * cell;
+
+        for (;;) {
+                if (pos & SEG_CLOSED)
+                        return 0;
+                cell = &seg->cell[pos & (QUEUE_SEG_SIZE - 1)];
+                long dif = (long)atomic_load_explicit(&cell->seq,
+                                memory_order_acquire) - (long)pos;
+                if (dif == 0) {
+                        if (atomic_compare_exchange_weak(&seg->tail,
+                                        &pos, pos + 1))
+                                break;
+                } else if (dif < 0) {
+                        /* Full: close it so it never takes work again */
+                        atomic_fetch_or(&seg->tail, SEG_CLOSED);
+                        return 0;
+                } else {
+                        pos = atomic_load(&seg->tail);
+                }
+        }
+        cell->proc = proc;
+        atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+        return 1;
+}
+
+static struct pcb_t * seg_pop(struct queue_seg_t * seg) {
+        unsigned long pos = atomic_load(&seg->head);
+        struct queue_cell_t * cell;
+        struct pcb_t * proc;
+
+        for (;;) {
+                cell = &seg->cell[pos & (QUEUE_SEG_SIZE - 1)];
+                long dif = (long)atomic_load_explicit(&cell->seq,
+                                memory_order_acquire) - (long)(pos + 1);
+                if (dif == 0) {
+                        if (atomic_compare_exchange_weak(&seg->head,
+                                        &pos, pos + 1))
+                                break;
+                } else if (dif < 0) {
+                        return NULL;
+                } else {
+                        pos = atomic_load(&seg->head);
+                }
+        }
+        proc = cell->proc;
+        atomic_store_explicit(&cell->seq, pos + QUEUE_SEG_SIZE,
+                        memory_order_release);
+        return proc;
+}
+
 int empty(struct queue_t * q) {
+        struct queue_seg_t * seg;
+        int is_empty = 1;
+
         if (q == NULL) return 1;
-	return (q->size == 0);
+        atomic_fetch_add(&q->users, 1);
+        for (seg = atomic_load(&q->head); seg != NULL;
+                        seg = atomic_load(&seg->next)) {
+                unsigned long tail = atomic_load(&seg->tail) & ~SEG_CLOSED;
+                if (atomic_load(&seg->head) < tail) {
+                        is_empty = 0;
+                        break;
+                }
+        }
+        atomic_fetch_sub(&q->users, 1);
+	return is_empty;
 }
 
 void enqueue(struct queue_t * q, struct pcb_t * proc) {
-        /* TODO: put a new process to queue [q] */
+        /* put a new process to queue [q] */
+        atomic_fetch_add(&q->users, 1);
+        for (;;) {
+                struct queue_seg_t * seg = tail_seg(q);
+                struct queue_seg_t * next;
+
+                if (seg_push(seg, proc))
+                        break;
+
+                /* Segment closed: go on with (or append) the next one.
+                 * If another producer linked one first, ours goes back
+                 * to the spares */
+                next = atomic_load(&seg->next);
+                if (next == NULL) {
+                        struct queue_seg_t * newseg = seg_alloc(q);
+                        if (atomic_compare_exchange_strong(&seg->next,
+                                        &next, newseg))
+                                next = newseg;
+                        else
+                                seg_push_free(&q->spare, newseg);
+                }
+                atomic_compare_exchange_strong(&q->tail, &seg, next);
+        }
+        atomic_fetch_sub(&q->users, 1);
 }
 
 struct pcb_t * dequeue(struct queue_t * q) {
-        /* TODO: return a pcb whose prioprity is the highest
-         * in the queue [q] and remember to remove it from q
-         * */
-	return NULL;
+        /* return the oldest pcb in the queue [q] and remove it from q */
+        struct pcb_t * proc = NULL;
+
+        atomic_fetch_add(&q->users, 1);
+        for (;;) {
+                struct queue_seg_t * seg = atomic_load(&q->head);
+                struct queue_seg_t * next;
+                unsigned long tail;
+
+                if (seg == NULL)
+                        break;
+                if ((proc = seg_pop(seg)) != NULL)
+                        break;
+
+                /* Move past the segment only once it is closed and every
+                 * claimed cell has been consumed */
+                tail = atomic_load(&seg->tail);
+                if (!(tail & SEG_CLOSED) ||
+                                atomic_load(&seg->head) < (tail & ~SEG_CLOSED))
+                        break;
+                if ((next = atomic_load(&seg->next)) == NULL)
+                        break;
+                if (atomic_compare_exchange_strong(&q->head, &seg, next)) {
+                        /* Others may still be at work on it */
+                        seg_push_free(&q->retired, seg);
+                        seg_recycle(q);
+                }
+        }
+        atomic_fetch_sub(&q->users, 1);
+        return proc;
+}
+
+void free_queue(struct queue_t * q) {
+        struct queue_seg_t * seg = atomic_load(&q->segs);
+
+        while (seg != NULL) {
+                struct queue_seg_t * next = seg->all_next;
+                free(seg);
+                seg = next;
+        }
+        atomic_store(&q->head, NULL);
+        atomic_store(&q->tail, NULL);
+        atomic_store(&q->segs, NULL);
+        atomic_store(&q->retired, NULL);
+        atomic_store(&q->spare, NULL);
+}
+
+int list_empty(struct pcb_list_t * l) {
+        return (l == NULL || l->head == NULL);
+}
+
+void list_enqueue(struct pcb_list_t * l, struct pcb_t * proc) {
+        proc->rq_list = l;
+        proc->rq_next = NULL;
+        proc->rq_prev = l->tail;
+        if (l->tail != NULL)
+                l->tail->rq_next = proc;
+        else
+                l->head = proc;
+        l->tail = proc;
+        l->size++;
+}
+
+void list_unlink(struct pcb_t * proc) {
+        struct pcb_list_t * l = proc->rq_list;
+
+        if (l == NULL)
+                return;
+        if (proc->rq_prev != NULL)
+                proc->rq_prev->rq_next = proc->rq_next;
+        else
+                l->head = proc->rq_next;
+        if (proc->rq_next != NULL)
+                proc->rq_next->rq_prev = proc->rq_prev;
+        else
+                l->tail = proc->rq_prev;
+        proc->rq_prev = proc->rq_next = NULL;
+        proc->rq_list = NULL;
+        l->size--;
+}
+
+struct pcb_t * list_dequeue(struct pcb_list_t * l) {
+        struct pcb_t * proc = l->head;
+
+        if (proc != NULL)
+                list_unlink(proc);
+        return proc;
+}
+
+static int tree_less(struct pcb_t * a, struct pcb_t * b) {
+        if (a->vruntime != b->vruntime)
+                return a->vruntime < b->vruntime;
+        return a->pid < b->pid;
+}
+
+static int tree_height(struct pcb_t * n) {
+        return n ? n->rq_height : 0;
 }
 
+static void tree_fix(struct pcb_t * n) {
+        int hl = tree_height(n->rq_left), hr = tree_height(n->rq_right);
+        n->rq_height = 1 + (hl > hr ? hl : hr);
+}
+
+static struct pcb_t * tree_rotate_right(struct pcb_t * n) {
+        struct pcb_t * l = n->rq_left;
+        n->rq_left = l->rq_right;
+        l->rq_right = n;
+        tree_fix(n);
+        tree_fix(l);
+        return l;
+}
+
+static struct pcb_t * tree_rotate_left(struct pcb_t * n) {
+        struct pcb_t * r = n->rq_right;
+        n->rq_right = r->rq_left;
+        r->rq_left = n;
+        tree_fix(n);
+        tree_fix(r);
+        return r;
+}
+
+static struct pcb_t * tree_balance(struct pcb_t * n) {
+        int bal;
+
+        tree_fix(n);
+        bal = tree_height(n->rq_left) - tree_height(n->rq_right);
+        if (bal > 1) {
+                if (tree_height(n->rq_left->rq_left) <
+                                tree_height(n->rq_left->rq_right))
+                        n->rq_left = tree_rotate_left(n->rq_left);
+                return tree_rotate_right(n);
+        }
+        if (bal < -1) {
+                if (tree_height(n->rq_right->rq_right) <
+                                tree_height(n->rq_right->rq_left))
+                        n->rq_right = tree_rotate_right(n->rq_right);
+                return tree_rotate_left(n);
+        }
+        return n;
+}
+
+static struct pcb_t * tree_do_insert(struct pcb_t * n, struct pcb_t * proc) {
+        if (n == NULL)
+                return proc;
+        if (tree_less(proc, n))
+                n->rq_left = tree_do_insert(n->rq_left, proc);
+        else
+                n->rq_right = tree_do_insert(n->rq_right, proc);
+        return tree_balance(n);
+}
+
+/* Detach the leftmost node of subtree [n] into [*min] */
+static struct pcb_t * tree_do_remove_min(struct pcb_t * n, struct pcb_t ** min) {
+        if (n->rq_left == NULL) {
+                *min = n;
+                return n->rq_right;
+        }
+        n->rq_left = tree_do_remove_min(n->rq_left, min);
+        return tree_balance(n);
+}
+
+static struct pcb_t * tree_do_remove(struct pcb_t * n, struct pcb_t * proc) {
+        struct pcb_t * succ;
+
+        if (n == NULL)
+                return NULL;
+        if (n != proc) {
+                if (tree_less(proc, n))
+                        n->rq_left = tree_do_remove(n->rq_left, proc);
+                else
+                        n->rq_right = tree_do_remove(n->rq_right, proc);
+                return tree_balance(n);
+        }
+        if (n->rq_right == NULL)
+                return n->rq_left;
+        n->rq_right = tree_do_remove_min(n->rq_right, &succ);
+        succ->rq_left = n->rq_left;
+        succ->rq_right = n->rq_right;
+        return tree_balance(succ);
+}
+
+void tree_insert(struct pcb_tree_t * t, struct pcb_t * proc) {
+        proc->rq_left = proc->rq_right = NULL;
+        proc->rq_height = 1;
+        proc->rq_tree = t;
+        t->root = tree_do_insert(t->root, proc);
+        t->size++;
+}
+
+void tree_remove(struct pcb_t * proc) {
+        struct pcb_tree_t * t = proc->rq_tree;
+
+        if (t == NULL)
+                return;
+        t->root = tree_do_remove(t->root, proc);
+        proc->rq_left = proc->rq_right = NULL;
+        proc->rq_tree = NULL;
+        t->size--;
+}
+
+struct pcb_t * tree_first(struct pcb_tree_t * t) {
+        struct pcb_t * n = t->root;
+
+        if (n == NULL)
+                return NULL;
+        while (n->rq_left != NULL)
+                n = n->rq_left;
+        return n;
+}
+
+
+static int heap_less(struct pcb_t * a, struct pcb_t * b) {
+        if (a->deadline != b->deadline)
+                return a->deadline < b->deadline;
+        return a->pid < b->pid;
+}
+
+static void heap_set(struct pcb_heap_t * h, int i, struct pcb_t * proc) {
+        h->proc[i] = proc;
+        proc->rq_index = i;
+}
+
+/* Move the member at [i] to where it belongs */
+static void heap_fix(struct pcb_heap_t * h, int i) {
+        struct pcb_t * proc = h->proc[i];
+
+        while (i > 0 && heap_less(proc, h->proc[(i - 1) / 2])) {
+                heap_set(h, i, h->proc[(i - 1) / 2]);
+                i = (i - 1) / 2;
+        }
+        for (;;) {
+                int child = 2 * i + 1;
+                if (child >= h->size)
+                        break;
+                if (child + 1 < h->size &&
+                    heap_less(h->proc[child + 1], h->proc[child]))
+                        child++;
+                if (!heap_less(h->proc[child], proc))
+                        break;
+                heap_set(h, i, h->proc[child]);
+                i = child;
+        }
+        heap_set(h, i, proc);
+}
+
+void heap_push(struct pcb_heap_t * h, struct pcb_t * proc) {
+        if (h->size == h->cap) {
+                h->cap = h->cap ? 2 * h->cap : 16;
+                h->proc = realloc(h->proc, h->cap * sizeof(struct pcb_t *));
+        }
+        heap_set(h, h->size++, proc);
+        heap_fix(h, h->size - 1);
+}
+
+struct pcb_t * heap_pop(struct pcb_heap_t * h) {
+        struct pcb_t * proc;
+
+        if (h->size == 0)
+                return NULL;
+        proc = h->proc[0];
+        heap_remove(h, proc);
+        return proc;
+}
+
+void heap_remove(struct pcb_heap_t * h, struct pcb_t * proc) {
+        int i = proc->rq_index;
+
+        proc->rq_index = -1;
+        if (--h->size > i) {
+                heap_set(h, i, h->proc[h->size]);
+                heap_fix(h, i);
+        }
+}
+
+void heap_free(struct pcb_heap_t * h) {
+        free(h->proc);
+        h->proc = NULL;
+        h->size = h->cap = 0;
+}
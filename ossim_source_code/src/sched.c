@@ -1,88 +1,904 @@
 
 #include "queue.h"
 #include "sched.h"
+#include "bitops.h"
+#include "timer.h"
 #include <pthread.h>
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 static struct queue_t ready_queue;
 static struct queue_t run_queue;
 static pthread_mutex_t queue_lock;
 
 #ifdef MLQ_SCHED
-static struct queue_t mlq_ready_queue[MAX_PRIO];
+/* Per-CPU run queue. Each CPU dispatches from and puts back to its
+ * own queue; an idle CPU steals from the busiest sibling.
+ * Other devices never touch the queue directly: they push into the
+ * lock-free inbox, which the owner (or a thief) drains under the run
+ * queue lock. Waiting processes are linked intrusively through pcb_t:
+ * on MLQ levels (lists, O(1)) or in the CFS tree (O(log n)) */
+struct sched_rq_t {
+	pthread_mutex_t lock;
+	struct queue_t inbox;
+	/* MLQ policy */
+	struct pcb_list_t ready_list[MAX_PRIO];
+	/* Occupancy bitmap: bit prio is set iff ready_list[prio] is not empty.
+	 * Written under the lock, with atomic bitops since other CPUs may
+	 * peek at it without */
+	unsigned long ready_map[BITS_TO_LONGS(MAX_PRIO)];
+	/* Levels that have used up their slots in the current round */
+	unsigned long spent_map[BITS_TO_LONGS(MAX_PRIO)];
+	/* Dispatches left to each level in the current round */
+	int slot[MAX_PRIO];
+	/* CFS policy */
+	struct pcb_tree_t cfs_tree;
+	uint64_t min_vruntime;
+	/* Number of waiting processes, inbox included, read without the lock */
+	int nr_ready;
+	/* Timer device driving the CPU */
+	struct timer_id_t * timer_id;
+	/* MLQ level of the running process, MAX_PRIO while idle, -1 for
+	 * an EDF process, whose deadline is then in curr_deadline */
+	int curr_prio;
+	uint64_t curr_deadline;
+	/* A more urgent process was added for this CPU: requeue the
+	 * running one before its next instruction */
+	int need_resched;
+	/* Slots the CPU spent running processes */
+	uint64_t busy;
+};
+
+static struct sched_rq_t * sched_rq;
+static int sched_num_cpus;
+static int sched_policy = SCHED_POLICY_MLQ;
+
+/* MLFQ bands and boost clock */
+static int mlfq_nr_bands = 1;
+static int mlfq_quanta[MLFQ_MAX_BANDS];
+static uint32_t mlfq_epoch = 0;
+static uint64_t mlfq_next_boost = MLFQ_BOOST_PERIOD;
+
+/* CPUs parked off the timer because they found nothing to run. Whoever
+ * makes work available clears a bit and unparks that CPU */
+static unsigned long * idle_map;
+static int sched_closing = 0;	// No more arrivals, parked CPUs must exit
+static int sched_nr_blocked = 0;	// Processes off the CPUs waiting for an event
+/* Quantum slots cut by preemption: the time urgent processes would
+ * otherwise have waited for their CPU */
+static uint64_t sched_preempt_saved = 0;
+
+/* Accounting of finished processes, sorted by pid, kept for the report */
+struct sched_stat_t {
+	uint32_t pid;
+	uint32_t prio;	// Level given at load
+	uint64_t arrival;
+	uint64_t dispatch;	// First dispatch
+	uint64_t finish;
+	uint64_t cpu_time;
+	uint32_t preemptions;
+	uint32_t migrations;
+	int rt;
+	int missed;	// Finished after its deadline
+	struct sched_stat_t * next;
+};
+
+static struct sched_stat_t * stat_list = NULL;
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *  Earliest deadline first class. Admitted real-time processes wait on
+ *  one heap shared by every CPU and are dispatched ahead of anything
+ *  in the run queues. Admission keeps the total density (wcet over
+ *  relative deadline) of the unfinished admitted processes within the
+ *  number of CPUs; a refused process runs as an ordinary one.
+ */
+#define EDF_DENSITY_ONE 1024
+
+static struct pcb_heap_t edf_heap;
+static pthread_mutex_t edf_lock = PTHREAD_MUTEX_INITIALIZER;
+static int edf_nr_ready = 0;	// Size of edf_heap, read without the lock
+static uint64_t edf_density = 0;
 #endif
 
 int queue_empty(void) {
 #ifdef MLQ_SCHED
-	unsigned long prio;
-	for (prio = 0; prio < MAX_PRIO; prio++)
-		if(!empty(&mlq_ready_queue[prio])) 
-			return -1;
+	int cpu;
+	for (cpu = 0; cpu < sched_num_cpus; cpu++)
+		if (__atomic_load_n(&sched_rq[cpu].nr_ready, __ATOMIC_SEQ_CST) > 0)
+			return 0;
+	if (__atomic_load_n(&edf_nr_ready, __ATOMIC_SEQ_CST) > 0)
+		return 0;
 #endif
 	return (empty(&ready_queue) && empty(&run_queue));
 }
 
-void init_scheduler(void) {
-#ifdef MLQ_SCHED
-    int i ;
+static const char * sched_policy_name[] = {"mlq", "cfs", "mlfq"};
 
-	for (i = 0; i < MAX_PRIO; i ++)
-		mlq_ready_queue[i].size = 0;
+int sched_policy_by_name(const char * name) {
+	int policy;
+	for (policy = SCHED_POLICY_MLQ; policy <= SCHED_POLICY_MLFQ; policy++)
+		if (!strcasecmp(name, sched_policy_name[policy]))
+			return policy;
+	return -1;
+}
+
+void init_scheduler(int num_cpus, int policy) {
+#ifdef MLQ_SCHED
+	int i, cpu;
+	sched_num_cpus = num_cpus;
+	sched_policy = policy;
+	sched_rq = (struct sched_rq_t *)calloc(num_cpus, sizeof(struct sched_rq_t));
+	for (cpu = 0; cpu < num_cpus; cpu++) {
+		for (i = 0; i < MAX_PRIO; i ++)
+			sched_rq[cpu].slot[i] = MAX_PRIO - i;
+		pthread_mutex_init(&sched_rq[cpu].lock, NULL);
+		sched_rq[cpu].curr_prio = MAX_PRIO;
+	}
+	idle_map = (unsigned long *)calloc(BITS_TO_LONGS(num_cpus),
+		sizeof(unsigned long));
 #endif
-	ready_queue.size = 0;
-	run_queue.size = 0;
 	pthread_mutex_init(&queue_lock, NULL);
 }
 
+void init_mlfq(int nr_bands, const int * quanta) {
+#ifdef MLQ_SCHED
+	int i;
+	if (nr_bands > MLFQ_MAX_BANDS)
+		nr_bands = MLFQ_MAX_BANDS;
+	mlfq_nr_bands = nr_bands;
+	for (i = 0; i < nr_bands; i++)
+		mlfq_quanta[i] = quanta[i];
+#endif
+}
+
 #ifdef MLQ_SCHED
 /* 
  *  Stateful design for routine calling
  *  based on the priority and our MLQ policy
  *  We implement stateful here using transition technique
  *  State representation   prio = 0 .. MAX_PRIO, curr_slot = 0..(MAX_PRIO - prio)
+ *
+ *  The highest level that is non-empty and still has slots left in this
+ *  round is found with one find-first-set over (ready & ~spent); once
+ *  every non-empty level is spent a new round starts.
+ *  The mlq_* and cfs_* helpers are called with rq->lock held.
+ */
+static void mlq_link(struct sched_rq_t * rq, struct pcb_t * proc) {
+	list_enqueue(&rq->ready_list[proc->prio], proc);
+	set_bit(proc->prio, rq->ready_map);
+}
+
+static void mlq_unlink(struct sched_rq_t * rq, struct pcb_t * proc) {
+	struct pcb_list_t * level = proc->rq_list;
+	list_unlink(proc);
+	if (list_empty(level))
+		clear_bit(level - rq->ready_list, rq->ready_map);
+}
+
+static struct pcb_t * mlq_pick(struct sched_rq_t * rq) {
+	int prio, i;
+
+	prio = find_first_andnot_bit(rq->ready_map, rq->spent_map, MAX_PRIO);
+	if (prio >= MAX_PRIO) {
+		if (find_first_bit(rq->ready_map, MAX_PRIO) >= MAX_PRIO)
+			return NULL;
+		/* Every waiting level is spent, start a new round */
+		for (i = 0; i < BITS_TO_LONGS(MAX_PRIO); i++)
+			rq->spent_map[i] = 0;
+		prio = find_first_bit(rq->ready_map, MAX_PRIO);
+	}
+	if (--rq->slot[prio] == 0) {
+		rq->slot[prio] = MAX_PRIO - prio;
+		__set_bit(prio, rq->spent_map);
+	}
+	return rq->ready_list[prio].head;
+}
+
+/*
+ *  Completely fair policy: every process accumulates virtual run time
+ *  at a rate inversely proportional to its weight, and the process
+ *  with the smallest vruntime runs next. Weights follow the Linux nice
+ *  table, with prio 0 .. MAX_PRIO-1 spread over nice -20 .. 19, so a
+ *  prio 130 job still gets its (small) share instead of starving.
+ */
+#define CFS_NICE_0_LOAD 1024
+#define CFS_VRUNTIME_NEW UINT64_MAX
+
+static const int cfs_prio_to_weight[40] = {
+ /* -20 */ 88761, 71755, 56483, 46273, 36291,
+ /* -15 */ 29154, 23254, 18705, 14949, 11916,
+ /* -10 */  9548,  7620,  6100,  4904,  3906,
+ /*  -5 */  3121,  2501,  1991,  1586,  1277,
+ /*   0 */  1024,   820,   655,   526,   423,
+ /*   5 */   335,   272,   215,   172,   137,
+ /*  10 */   110,    87,    70,    56,    45,
+ /*  15 */    36,    29,    23,    18,    15,
+};
+
+static int cfs_weight(struct pcb_t * proc) {
+	uint32_t prio = proc->prio < MAX_PRIO ? proc->prio : MAX_PRIO - 1;
+	return cfs_prio_to_weight[prio * 40 / MAX_PRIO];
+}
+
+static void cfs_link(struct sched_rq_t * rq, struct pcb_t * proc) {
+	/* Newcomers start level with the queue instead of far behind it */
+	if (proc->vruntime == CFS_VRUNTIME_NEW ||
+			proc->vruntime < rq->min_vruntime)
+		proc->vruntime = rq->min_vruntime;
+	tree_insert(&rq->cfs_tree, proc);
+}
+
+static struct pcb_t * cfs_pick(struct sched_rq_t * rq) {
+	struct pcb_t * proc = tree_first(&rq->cfs_tree);
+	if (proc != NULL && proc->vruntime > rq->min_vruntime)
+		rq->min_vruntime = proc->vruntime;
+	return proc;
+}
+
+/* Charge the slots [proc] ran since it was dispatched */
+static void cfs_account(struct pcb_t * proc) {
+	uint64_t ran = current_time() - proc->exec_start;
+	proc->vruntime += (ran * CFS_NICE_0_LOAD * 1024) / cfs_weight(proc);
+}
+
+static void rq_link(struct sched_rq_t * rq, struct pcb_t * proc) {
+	if (sched_policy == SCHED_POLICY_CFS)
+		cfs_link(rq, proc);
+	else
+		mlq_link(rq, proc);
+}
+
+static void rq_unlink(struct sched_rq_t * rq, struct pcb_t * proc) {
+	if (proc->rq_tree != NULL)
+		tree_remove(proc);
+	else
+		mlq_unlink(rq, proc);
+}
+
+/* Move what other devices pushed into the queue */
+static void rq_drain(struct sched_rq_t * rq) {
+	struct pcb_t * proc;
+	while ((proc = dequeue(&rq->inbox)) != NULL)
+		rq_link(rq, proc);
+}
+
+/* Take [proc] off [rq] to run it */
+static void rq_take(struct sched_rq_t * rq, struct pcb_t * proc) {
+	rq_unlink(rq, proc);
+	__atomic_sub_fetch(&rq->nr_ready, 1, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&proc->rq_cpu, -1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ *  Multi-level feedback: MLQ levels are grouped into bands, each with
+ *  its own quantum. A process that uses up its whole quantum drops to
+ *  the first level of the next band; one that gives the CPU back early
+ *  (preempted) keeps its level. Every MLFQ_BOOST_PERIOD slots all
+ *  processes go back to their base level.
+ */
+static int mlfq_band(uint32_t prio) {
+	if (prio >= MAX_PRIO)
+		prio = MAX_PRIO - 1;
+	return prio * mlfq_nr_bands / MAX_PRIO;
+}
+
+/* Move waiting [proc] of locked [rq] to level [prio] */
+static void rq_set_prio(struct sched_rq_t * rq, struct pcb_t * proc,
+		uint32_t prio) {
+	rq_unlink(rq, proc);
+	proc->prio = prio;
+	rq_link(rq, proc);
+}
+
+/* Return the waiting processes of [rq] to their base level. A process
+ * only ever moves up, to a level the scan is done with */
+static void mlfq_boost_rq(struct sched_rq_t * rq, uint32_t epoch) {
+	struct pcb_t * proc, * next;
+	int prio;
+
+	pthread_mutex_lock(&rq->lock);
+	rq_drain(rq);
+	for (prio = 0; prio < MAX_PRIO; prio++) {
+		for (proc = rq->ready_list[prio].head; proc != NULL;
+				proc = next) {
+			next = proc->rq_next;
+			proc->mlfq_epoch = epoch;
+			if (proc->base_prio != proc->prio)
+				rq_set_prio(rq, proc, proc->base_prio);
+		}
+	}
+	pthread_mutex_unlock(&rq->lock);
+}
+
+/* Boost everybody if the period is over. Running processes see the new
+ * epoch when they are put back */
+static void mlfq_boost(void) {
+	uint64_t next = __atomic_load_n(&mlfq_next_boost, __ATOMIC_SEQ_CST);
+	uint32_t epoch;
+	int cpu;
+
+	if (current_time() < next || !__atomic_compare_exchange_n(
+			&mlfq_next_boost, &next, current_time() + MLFQ_BOOST_PERIOD,
+			0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+		return;
+	epoch = __atomic_add_fetch(&mlfq_epoch, 1, __ATOMIC_SEQ_CST);
+	for (cpu = 0; cpu < sched_num_cpus; cpu++)
+		mlfq_boost_rq(&sched_rq[cpu], epoch);
+}
+
+/* Demote [proc] if it ran its whole quantum, called before requeueing */
+static void mlfq_account(struct pcb_t * proc) {
+	uint32_t epoch = __atomic_load_n(&mlfq_epoch, __ATOMIC_SEQ_CST);
+	int band = mlfq_band(proc->prio);
+
+	if (proc->mlfq_epoch != epoch) {
+		proc->mlfq_epoch = epoch;
+		set_proc_prio(proc, proc->base_prio);
+	}else if (band + 1 < mlfq_nr_bands && current_time() -
+			proc->exec_start >= (uint64_t)mlfq_quanta[band]) {
+		/* First level of the next band */
+		set_proc_prio(proc, ((band + 1) * MAX_PRIO +
+			mlfq_nr_bands - 1) / mlfq_nr_bands);
+	}
+}
+
+int get_quantum(struct pcb_t * proc, int time_slot) {
+	if (sched_policy == SCHED_POLICY_MLFQ)
+		return mlfq_quanta[mlfq_band(proc->prio)];
+	return time_slot;
+}
+
+static struct pcb_t * rq_pick(struct sched_rq_t * rq) {
+	struct pcb_t * proc;
+
+	rq_drain(rq);
+	if (sched_policy == SCHED_POLICY_CFS)
+		proc = cfs_pick(rq);
+	else
+		proc = mlq_pick(rq);
+	if (proc != NULL)
+		rq_take(rq, proc);
+	return proc;
+}
+
+/* Hand [proc] to CPU [cpu] without taking its lock. It is counted
+ * before it becomes visible, so queue_empty() never misses it */
+static void rq_push(int cpu, struct pcb_t * proc) {
+	__atomic_store_n(&proc->rq_cpu, cpu, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&sched_rq[cpu].nr_ready, 1, __ATOMIC_SEQ_CST);
+	enqueue(&sched_rq[cpu].inbox, proc);
+}
+
+/* Take one process from the run queue [victim] for CPU [cpu]: the head
+ * of its most urgent level, or its leftmost CFS entry. The victim's
+ * round and min_vruntime are left alone, they belong to the dispatches
+ * of its own CPU */
+static struct pcb_t * rq_steal_from(int cpu, struct sched_rq_t * victim) {
+	struct pcb_t * proc = NULL;
+	int prio;
+
+	pthread_mutex_lock(&victim->lock);
+	rq_drain(victim);
+	if (sched_policy == SCHED_POLICY_CFS) {
+		proc = tree_first(&victim->cfs_tree);
+	} else {
+		prio = find_first_bit(victim->ready_map, MAX_PRIO);
+		if (prio < MAX_PRIO)
+			proc = victim->ready_list[prio].head;
+	}
+	if (proc != NULL)
+		rq_take(victim, proc);
+	if (proc != NULL && sched_policy == SCHED_POLICY_CFS) {
+		/* Keep its lag relative to the queue it joins */
+		proc->vruntime = proc->vruntime - victim->min_vruntime
+			+ sched_rq[cpu].min_vruntime;
+	}
+	pthread_mutex_unlock(&victim->lock);
+	return proc;
+}
+
+/* Take one process from the sibling with the most waiting processes */
+static struct pcb_t * rq_steal(int cpu) {
+	struct sched_rq_t * victim = NULL;
+	int i, busiest = 0;
+
+	for (i = 0; i < sched_num_cpus; i++) {
+		int nr = __atomic_load_n(&sched_rq[i].nr_ready, __ATOMIC_RELAXED);
+		if (i != cpu && nr > busiest) {
+			busiest = nr;
+			victim = &sched_rq[i];
+		}
+	}
+	if (victim == NULL)
+		return NULL;
+	return rq_steal_from(cpu, victim);
+}
+
+/* Sibling of [cpu] whose best waiting MLQ level beats [prio] by more
+ * than AFFINITY_PRIO_TOLERANCE, NULL if staying local is good enough.
+ * The siblings' bitmaps are only peeked at, without their lock */
+static struct sched_rq_t * rq_better_sibling(int cpu, int prio) {
+	struct sched_rq_t * best = NULL;
+	int i, best_prio = prio - AFFINITY_PRIO_TOLERANCE;
+
+	for (i = 0; i < sched_num_cpus; i++) {
+		int p = find_first_bit(sched_rq[i].ready_map, MAX_PRIO);
+		if (i != cpu && p < best_prio) {
+			best_prio = p;
+			best = &sched_rq[i];
+		}
+	}
+	return best;
+}
+
+/* Lock the run queue [proc] waits on, with every pushed process linked.
+ * Return NULL (nothing locked) if [proc] is not waiting anywhere */
+static struct sched_rq_t * rq_lock_proc(struct pcb_t * proc) {
+	for (;;) {
+		int cpu = __atomic_load_n(&proc->rq_cpu, __ATOMIC_SEQ_CST);
+		struct sched_rq_t * rq;
+		if (cpu < 0)
+			return NULL;
+		rq = &sched_rq[cpu];
+		pthread_mutex_lock(&rq->lock);
+		rq_drain(rq);
+		if ((proc->rq_list != NULL || proc->rq_tree != NULL) &&
+				__atomic_load_n(&proc->rq_cpu, __ATOMIC_SEQ_CST) == cpu)
+			return rq;
+		/* Dispatched, stolen or still on its way into the inbox */
+		pthread_mutex_unlock(&rq->lock);
+	}
+}
+
+static uint64_t edf_proc_density(struct pcb_t * proc) {
+	uint64_t wcet = proc->wcet ? proc->wcet : proc->code->size;
+	uint64_t relative = proc->deadline - proc->arrival;
+	return (wcet * EDF_DENSITY_ONE + relative - 1) / relative;
+}
+
+static int edf_admit(struct pcb_t * proc) {
+	uint64_t density = edf_proc_density(proc);
+	int admitted;
+
+	pthread_mutex_lock(&edf_lock);
+	admitted = density <= EDF_DENSITY_ONE && edf_density + density <=
+		(uint64_t)sched_num_cpus * EDF_DENSITY_ONE;
+	if (admitted)
+		edf_density += density;
+	pthread_mutex_unlock(&edf_lock);
+	return admitted;
+}
+
+static void edf_push(struct pcb_t * proc) {
+	pthread_mutex_lock(&edf_lock);
+	heap_push(&edf_heap, proc);
+	__atomic_store_n(&edf_nr_ready, edf_heap.size, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&edf_lock);
+}
+
+static struct pcb_t * edf_pick(void) {
+	struct pcb_t * proc;
+
+	if (__atomic_load_n(&edf_nr_ready, __ATOMIC_SEQ_CST) == 0)
+		return NULL;
+	pthread_mutex_lock(&edf_lock);
+	proc = heap_pop(&edf_heap);
+	__atomic_store_n(&edf_nr_ready, edf_heap.size, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&edf_lock);
+	return proc;
+}
+
+/*
+ *  Pick from the run queues for CPU [cpu]. A process is put back to the
+ *  run queue of the CPU that ran it, so picking locally keeps it where
+ *  its cache is warm. Under MLQ a sibling's process is only pulled over
+ *  when it is more than AFFINITY_PRIO_TOLERANCE levels more urgent than
+ *  the best local one, or when the local queue is empty.
  */
-struct pcb_t * get_mlq_proc(void) {
+static struct pcb_t * rq_dispatch(int cpu) {
+	struct sched_rq_t * rq = &sched_rq[cpu];
+	struct sched_rq_t * better = NULL;
 	struct pcb_t * proc = NULL;
-	/*TODO: get a process from PRIORITY [ready_queue].
-	 * Remember to use lock to protect the queue.
-	 * */
+
+	if (sched_policy == SCHED_POLICY_MLFQ)
+		mlfq_boost();
+	pthread_mutex_lock(&rq->lock);
+	rq_drain(rq);
+	if (sched_policy != SCHED_POLICY_CFS)
+		better = rq_better_sibling(cpu,
+			find_first_bit(rq->ready_map, MAX_PRIO));
+	if (better == NULL)
+		proc = rq_pick(rq);
+	pthread_mutex_unlock(&rq->lock);
+	if (better != NULL)
+		proc = rq_steal_from(cpu, better);
+	if (proc == NULL) {
+		pthread_mutex_lock(&rq->lock);
+		proc = rq_pick(rq);
+		pthread_mutex_unlock(&rq->lock);
+	}
+	if (proc == NULL)
+		proc = rq_steal(cpu);
+	return proc;
+}
+
+/* Dispatch for CPU [cpu]: EDF processes first, then the run queues */
+struct pcb_t * get_proc(int cpu) {
+	struct sched_rq_t * rq = &sched_rq[cpu];
+	struct pcb_t * proc;
+
+	/* Clear the flag before the pick: a process added meanwhile flags
+	 * the CPU again rather than waiting behind the one picked here */
+	__atomic_exchange_n(&rq->need_resched, 0, __ATOMIC_SEQ_CST);
+	if ((proc = edf_pick()) == NULL)
+		proc = rq_dispatch(cpu);
+	if (proc != NULL) {
+		if (proc->last_cpu < 0)
+			proc->response = current_time() - proc->arrival;
+		else if (proc->last_cpu != cpu)
+			proc->migrations++;
+		proc->last_cpu = cpu;
+		proc->exec_start = current_time();
+	}
+	if (proc != NULL && proc->rt == 1) {
+		__atomic_store_n(&rq->curr_deadline, proc->deadline,
+			__ATOMIC_SEQ_CST);
+		__atomic_store_n(&rq->curr_prio, -1, __ATOMIC_SEQ_CST);
+	}else{
+		__atomic_store_n(&rq->curr_prio,
+			proc != NULL ? (int)proc->prio : MAX_PRIO,
+			__ATOMIC_SEQ_CST);
+	}
 	return proc;	
 }
 
-void put_mlq_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&mlq_ready_queue[proc->prio], proc);
-	pthread_mutex_unlock(&queue_lock);
+/* Unpark one idle CPU, if any, to pick up newly available work */
+static void wake_one_cpu(void) {
+	int cpu;
+
+	while ((cpu = find_first_bit(idle_map, sched_num_cpus))
+			< sched_num_cpus) {
+		if (test_and_clear_bit(cpu, idle_map)) {
+			timer_unpark(sched_rq[cpu].timer_id);
+			return;
+		}
+	}
 }
 
-void add_mlq_proc(struct pcb_t * proc) {
-	pthread_mutex_lock(&queue_lock);
-	enqueue(&mlq_ready_queue[proc->prio], proc);
-	pthread_mutex_unlock(&queue_lock);	
+/*
+ *  Park CPU [cpu] until there is work for it. The idle bit is published
+ *  before the queues are checked again, so a process pushed in between
+ *  is either seen here or its pusher finds the bit and unparks us.
+ *  Return 0 if the CPU should rather take an idle slot and retry.
+ */
+int park_cpu(int cpu) {
+	set_bit(cpu, idle_map);
+	if (__atomic_load_n(&sched_closing, __ATOMIC_SEQ_CST) ||
+			!queue_empty()) {
+		if (test_and_clear_bit(cpu, idle_map))
+			return 0;
+		/* Somebody is unparking us already: consume its wake-up */
+	}
+	timer_park(sched_rq[cpu].timer_id);
+	return 1;
+}
+
+void attach_cpu(int cpu, struct timer_id_t * timer_id) {
+	sched_rq[cpu].timer_id = timer_id;
 }
 
-struct pcb_t * get_proc(void) {
-	return get_mlq_proc();
+/* Ask CPU [cpu] to requeue its running process, cutting short the
+ * stretch of slots it may be sleeping through */
+static void resched_cpu(int cpu) {
+	__atomic_store_n(&sched_rq[cpu].need_resched, 1, __ATOMIC_SEQ_CST);
+	timer_unpark(sched_rq[cpu].timer_id);
 }
 
-void put_proc(struct pcb_t * proc) {
-	return put_mlq_proc(proc);
+void end_of_arrivals(void) {
+	int cpu;
+
+	__atomic_store_n(&sched_closing, 1, __ATOMIC_SEQ_CST);
+	for (cpu = 0; cpu < sched_num_cpus; cpu++)
+		if (test_and_clear_bit(cpu, idle_map))
+			timer_unpark(sched_rq[cpu].timer_id);
+}
+
+/* Charge the slots [proc] ran since its dispatch to it and its CPU */
+static void account_run(struct pcb_t * proc) {
+	uint64_t ran = current_time() - proc->exec_start;
+	proc->cpu_time += ran;
+	__atomic_add_fetch(&sched_rq[proc->last_cpu].busy, ran,
+		__ATOMIC_RELAXED);
+}
+
+void put_proc(struct pcb_t * proc, int cpu) {
+	account_run(proc);
+	if (proc->rt == 1) {
+		edf_push(proc);
+		if (__atomic_load_n(&edf_nr_ready, __ATOMIC_SEQ_CST) > 1)
+			wake_one_cpu();
+		return;
+	}
+	if (sched_policy == SCHED_POLICY_CFS)
+		cfs_account(proc);
+	else if (sched_policy == SCHED_POLICY_MLFQ)
+		mlfq_account(proc);
+	rq_push(cpu, proc);
+	/* The putting CPU takes one of them itself */
+	if (__atomic_load_n(&sched_rq[cpu].nr_ready, __ATOMIC_RELAXED) > 1)
+		wake_one_cpu();
+}
+
+void block_proc(struct pcb_t * proc) {
+	account_run(proc);
+	if (proc->rt != 1 && sched_policy == SCHED_POLICY_CFS)
+		cfs_account(proc);
+	else if (proc->rt != 1 && sched_policy == SCHED_POLICY_MLFQ)
+		mlfq_account(proc);
+	__atomic_add_fetch(&sched_nr_blocked, 1, __ATOMIC_SEQ_CST);
+}
+
+void wake_proc(struct pcb_t * proc) {
+	if (proc->rt == 1)
+		edf_push(proc);
+	else
+		rq_push(proc->last_cpu, proc);
+	/* Queued before it stops counting as blocked, so a CPU never sees
+	 * it nowhere and stops */
+	__atomic_sub_fetch(&sched_nr_blocked, 1, __ATOMIC_SEQ_CST);
+	wake_one_cpu();
+}
+
+int procs_blocked(void) {
+	return __atomic_load_n(&sched_nr_blocked, __ATOMIC_SEQ_CST);
 }
 
+#ifdef SCHED_PREEMPT
+/* CPU running the least urgent process if [proc] beats it and no CPU
+ * is idle, -1 otherwise. An EDF process beats any ordinary one, and
+ * an EDF one with a later deadline */
+static int preempt_target(struct pcb_t * proc) {
+	int i, victim = -1, worst = proc->rt == 1 ? -1 : (int)proc->prio;
+	uint64_t latest = proc->deadline;
+
+	if (proc->rt != 1 && sched_policy == SCHED_POLICY_CFS)
+		return -1;
+	for (i = 0; i < sched_num_cpus; i++) {
+		int prio = __atomic_load_n(&sched_rq[i].curr_prio,
+			__ATOMIC_SEQ_CST);
+		if (prio >= MAX_PRIO)
+			return -1;
+		if (prio > worst) {
+			worst = prio;
+			victim = i;
+		}else if (worst < 0 && prio < 0) {
+			uint64_t deadline = __atomic_load_n(
+				&sched_rq[i].curr_deadline, __ATOMIC_SEQ_CST);
+			if (deadline > latest) {
+				latest = deadline;
+				victim = i;
+			}
+		}
+	}
+	return victim;
+}
+#endif
+
 void add_proc(struct pcb_t * proc) {
-	return add_mlq_proc(proc);
+	/* New processes go to the least loaded CPU */
+	int i, target = 0;
+	proc->vruntime = CFS_VRUNTIME_NEW;
+	proc->arrival = current_time();
+	proc->base_prio = proc->prio;
+	proc->mlfq_epoch = __atomic_load_n(&mlfq_epoch, __ATOMIC_SEQ_CST);
+	if (proc->deadline > 0) {
+		proc->deadline += proc->arrival;
+		proc->rt = edf_admit(proc) ? 1 : -1;
+	}
+	if (proc->rt == 1) {
+		edf_push(proc);
+#ifdef SCHED_PREEMPT
+		if ((target = preempt_target(proc)) >= 0) {
+			resched_cpu(target);
+			return;
+		}
+#endif
+		wake_one_cpu();
+		return;
+	}
+#ifdef SCHED_PREEMPT
+	if ((target = preempt_target(proc)) >= 0) {
+		/* Queue it where it will be dispatched next */
+		rq_push(target, proc);
+		resched_cpu(target);
+		return;
+	}
+	target = 0;
+#endif
+	for (i = 1; i < sched_num_cpus; i++)
+		if (__atomic_load_n(&sched_rq[i].nr_ready, __ATOMIC_RELAXED) <
+		    __atomic_load_n(&sched_rq[target].nr_ready, __ATOMIC_RELAXED))
+			target = i;
+	rq_push(target, proc);
+	wake_one_cpu();
+}
+
+int need_resched(int cpu) {
+	return __atomic_load_n(&sched_rq[cpu].need_resched, __ATOMIC_SEQ_CST);
+}
+
+void preempt_proc(struct pcb_t * proc, int slots_left) {
+	proc->preemptions++;
+	__atomic_add_fetch(&sched_preempt_saved, slots_left, __ATOMIC_RELAXED);
+}
+
+void set_proc_prio(struct pcb_t * proc, uint32_t prio) {
+	struct sched_rq_t * rq = rq_lock_proc(proc);
+	if (rq == NULL) {
+		proc->prio = prio;
+		return;
+	}
+	rq_set_prio(rq, proc, prio);
+	pthread_mutex_unlock(&rq->lock);
+}
+
+void finish_proc(struct pcb_t * proc) {
+	struct sched_stat_t * stat = malloc(sizeof(struct sched_stat_t));
+	struct sched_stat_t ** it;
+
+	account_run(proc);
+	stat->pid = proc->pid;
+	stat->prio = proc->base_prio;
+	stat->arrival = proc->arrival;
+	stat->dispatch = proc->arrival + proc->response;
+	stat->finish = current_time();
+	stat->cpu_time = proc->cpu_time;
+	stat->preemptions = proc->preemptions;
+	stat->migrations = proc->migrations;
+	stat->rt = proc->rt;
+	stat->missed = proc->rt != 0 && current_time() > proc->deadline;
+	if (proc->rt == 1) {
+		pthread_mutex_lock(&edf_lock);
+		edf_density -= edf_proc_density(proc);
+		pthread_mutex_unlock(&edf_lock);
+	}
+	pthread_mutex_lock(&stat_lock);
+	for (it = &stat_list; *it != NULL && (*it)->pid < stat->pid;
+			it = &(*it)->next);
+	stat->next = *it;
+	*it = stat;
+	pthread_mutex_unlock(&stat_lock);
+}
+
+static const char * stat_deadline(struct sched_stat_t * stat) {
+	if (stat->rt == 0)
+		return "-";
+	if (stat->rt < 0)
+		return "refused";
+	return stat->missed ? "MISSED" : "met";
+}
+
+/*
+ *  Summary of the run: one row per finished process, in pid order, then
+ *  one per CPU. Waiting is the time a process spent ready but not
+ *  running: turnaround minus the slots it ran. CPU idle time is counted
+ *  up to the last finish.
+ */
+void finish_scheduler(const char * csv) {
+	struct sched_stat_t * stat;
+	uint64_t total_response = 0, total_wait = 0, total_turnaround = 0;
+	uint64_t end = 0;
+	int nr_procs = 0, nr_rt = 0, nr_missed = 0, cpu;
+	FILE * out = NULL;
+
+	if (csv != NULL && (out = fopen(csv, "w")) == NULL)
+		printf("Cannot write report to %s\n", csv);
+	if (out != NULL)
+		fprintf(out, "pid,prio,arrival,dispatch,finish,run,waiting,"
+			"turnaround,response,preemptions,migrations,"
+			"deadline\n");
+	printf("\nScheduling summary (%s):\n", sched_policy_name[sched_policy]);
+	printf("\t PID PRIO ARRIVAL DISPATCH FINISH   RUN  WAIT TURNAROUND "
+		"PREEMPT MIGRATE DEADLINE\n");
+	while ((stat = stat_list) != NULL) {
+		uint64_t turnaround = stat->finish - stat->arrival;
+		uint64_t wait = turnaround - stat->cpu_time;
+		printf("\t%4u %4u %7lu %8lu %6lu %5lu %5lu %10lu %7u %7u %s\n",
+			stat->pid, stat->prio, (unsigned long)stat->arrival,
+			(unsigned long)stat->dispatch,
+			(unsigned long)stat->finish,
+			(unsigned long)stat->cpu_time, (unsigned long)wait,
+			(unsigned long)turnaround, stat->preemptions,
+			stat->migrations, stat_deadline(stat));
+		if (out != NULL)
+			fprintf(out, "%u,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%u,%u,%s\n",
+				stat->pid, stat->prio,
+				(unsigned long)stat->arrival,
+				(unsigned long)stat->dispatch,
+				(unsigned long)stat->finish,
+				(unsigned long)stat->cpu_time,
+				(unsigned long)wait, (unsigned long)turnaround,
+				(unsigned long)(stat->dispatch - stat->arrival),
+				stat->preemptions, stat->migrations,
+				stat_deadline(stat));
+		total_response += stat->dispatch - stat->arrival;
+		total_wait += wait;
+		total_turnaround += turnaround;
+		if (stat->finish > end)
+			end = stat->finish;
+		nr_procs++;
+		if (stat->rt == 1) {
+			nr_rt++;
+			nr_missed += stat->missed;
+		}
+		stat_list = stat->next;
+		free(stat);
+	}
+	if (nr_procs > 0)
+		printf("\tAverage: response %.2f, waiting %.2f, "
+			"turnaround %.2f slots\n",
+			(double)total_response / nr_procs,
+			(double)total_wait / nr_procs,
+			(double)total_turnaround / nr_procs);
+	if (nr_procs > 0 && sched_preempt_saved > 0)
+		printf("\tPreemption: %lu slots of waiting saved, average "
+			"response %.2f without it\n",
+			(unsigned long)sched_preempt_saved,
+			(double)(total_response + sched_preempt_saved) /
+			nr_procs);
+	if (nr_rt > 0)
+		printf("\tDeadline misses: %d of %d admitted\n",
+			nr_missed, nr_rt);
+
+	if (out != NULL)
+		fprintf(out, "\ncpu,busy,idle,utilization\n");
+	printf("\t CPU  BUSY  IDLE   UTIL\n");
+	for (cpu = 0; cpu < sched_num_cpus; cpu++) {
+		uint64_t busy = sched_rq[cpu].busy;
+		uint64_t idle = end > busy ? end - busy : 0;
+		double util = end > 0 ? 100.0 * busy / end : 0;
+		printf("\t%4d %5lu %5lu %5.1f%%\n", cpu, (unsigned long)busy,
+			(unsigned long)idle, util);
+		if (out != NULL)
+			fprintf(out, "%d,%lu,%lu,%.1f\n", cpu,
+				(unsigned long)busy, (unsigned long)idle, util);
+	}
+	if (out != NULL)
+		fclose(out);
+
+	for (cpu = 0; cpu < sched_num_cpus; cpu++) {
+		free_queue(&sched_rq[cpu].inbox);
+		pthread_mutex_destroy(&sched_rq[cpu].lock);
+	}
+	free(sched_rq);
+	sched_rq = NULL;
+	sched_num_cpus = 0;
+	free(idle_map);
+	heap_free(&edf_heap);
 }
 #else
-struct pcb_t * get_proc(void) {
-	struct pcb_t * proc = NULL;
-	/*TODO: get a process from [ready_queue].
-	 * Remember to use lock to protect the queue.
-	 * */
+static int sched_nr_blocked = 0;	// Processes off the CPUs waiting for an event
+
+/* One queue shared by every CPU: processes that used up their time slot
+ * wait in [run_queue] until [ready_queue] runs dry */
+struct pcb_t * get_proc(int cpu) {
+	struct pcb_t * proc;
+
+	pthread_mutex_lock(&queue_lock);
+	if (empty(&ready_queue)) {
+		/* Start a new round */
+		while ((proc = dequeue(&run_queue)) != NULL)
+			enqueue(&ready_queue, proc);
+	}
+	proc = dequeue(&ready_queue);
+	pthread_mutex_unlock(&queue_lock);
 	return proc;
 }
 
-void put_proc(struct pcb_t * proc) {
+void put_proc(struct pcb_t * proc, int cpu) {
 	pthread_mutex_lock(&queue_lock);
 	enqueue(&run_queue, proc);
 	pthread_mutex_unlock(&queue_lock);
@@ -93,6 +909,47 @@ void add_proc(struct pcb_t * proc) {
 	enqueue(&ready_queue, proc);
 	pthread_mutex_unlock(&queue_lock);	
 }
+
+void finish_proc(struct pcb_t * proc) {
+}
+
+void attach_cpu(int cpu, struct timer_id_t * timer_id) {
+}
+
+int park_cpu(int cpu) {
+	return 0;
+}
+
+int need_resched(int cpu) {
+	return 0;
+}
+
+void preempt_proc(struct pcb_t * proc, int slots_left) {
+	proc->preemptions++;
+}
+
+int get_quantum(struct pcb_t * proc, int time_slot) {
+	return time_slot;
+}
+
+void end_of_arrivals(void) {
+}
+
+void block_proc(struct pcb_t * proc) {
+	__atomic_add_fetch(&sched_nr_blocked, 1, __ATOMIC_SEQ_CST);
+}
+
+void wake_proc(struct pcb_t * proc) {
+	put_proc(proc, proc->last_cpu);
+	__atomic_sub_fetch(&sched_nr_blocked, 1, __ATOMIC_SEQ_CST);
+}
+
+int procs_blocked(void) {
+	return __atomic_load_n(&sched_nr_blocked, __ATOMIC_SEQ_CST);
+}
+
+void finish_scheduler(const char * csv) {
+}
 #endif
 
 
@@ -1,79 +1,267 @@
 
 #include "timer.h"
+#include "os-cfg.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <ucontext.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
-static pthread_t _timer;
+/* Number of polls on the barrier sense before a device parks in the kernel */
+#define TIMER_SPIN_LIMIT 256
+/* Stack of a device coroutine in the cooperative engine */
+#define TIMER_CO_STACKSZ (256 * 1024)
 
 struct timer_id_container_t {
 	struct timer_id_t id;
 	struct timer_id_container_t * next;
+	/* Cooperative engine only */
+	ucontext_t ctx;
+	void * stack;
+	void * (*routine)(void *);
+	void * arg;
+	struct timer_id_container_t * co_next;
+	/* Parking: a parked device has left the barrier and sleeps until
+	 * another device unparks it */
+	pthread_mutex_t park_lock;
+	pthread_cond_t park_cond;
+	int parked;
+	int wake_pending;	// Unparked before it managed to park
+	/* Slot a sleeping device is due back at, TIMER_NEVER if it waits
+	 * for timer_unpark() only */
+	_Atomic uint64_t wake_at;
 };
 
 static struct timer_id_container_t * dev_list = NULL;
 
+/* Cooperative engine: devices are coroutines stepped in spawn order by
+ * timer_coop_run() on a single thread, next_slot() just yields back */
+static int coop = 0;
+static ucontext_t engine_ctx;
+static struct timer_id_container_t * co_head = NULL;
+static struct timer_id_container_t * co_tail = NULL;
+static struct timer_id_container_t * co_current = NULL;
+
 static uint64_t _time;
 
 static int timer_started = 0;
-static int timer_stop = 0;
 
+/* Sense-reversing slot barrier. Every attached device arrives once per
+ * slot; the last one to arrive advances the clock, reloads the counter
+ * and flips the global sense, which releases all the others at once. */
+static atomic_int bar_count;	// Devices that have not arrived in this slot
+static atomic_int bar_parties;	// Devices still attached to the barrier
+static atomic_int bar_sense;	// Global sense of the current slot
+static atomic_int bar_sleepers;	// Devices parked on bar_sense
+static atomic_int bar_nr_asleep;	// Devices in next_slots()
 
-static void * timer_routine(void * args) {
-	while (!timer_stop) {
-		printf("Time slot %3lu\n", current_time());
-		int fsh = 0;
-		int event = 0;
-		/* Wait for all devices have done the job in current
-		 * time slot */
-		struct timer_id_container_t * temp;
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.event_lock);
-			while (!temp->id.done && !temp->id.fsh) {
-				pthread_cond_wait(
-					&temp->id.event_cond,
-					&temp->id.event_lock
-				);
-			}
-			if (temp->id.fsh) {
-				fsh++;
-			}
-			event++;
-			pthread_mutex_unlock(&temp->id.event_lock);
+/* Move the clock to the slot before [wake], reporting the slots passed
+ * over at once. They are idle unless some device sleeps through them */
+static void timer_jump(uint64_t wake) {
+	const char * idle = atomic_load(&bar_nr_asleep) ? "" : ": idle";
+	if (wake - 1 == _time + 1) {
+		printf("Time slot %3lu%s\n", (unsigned long)(_time + 1), idle);
+	}else{
+		printf("Time slot %3lu - %3lu%s\n", (unsigned long)(_time + 1),
+			(unsigned long)(wake - 1), idle);
+	}
+	_time = wake - 1;
+}
+
+#ifdef TIMER_SKIP_IDLE
+/* Event skipping: if no device did any work in a slot, the clock jumps
+ * straight to the earliest slot some device asked to be woken up at */
+static atomic_int bar_busy;		// Some device did work in this slot
+static atomic_ullong bar_wake;		// Earliest wake-up asked in this slot
+
+static void bar_report_idle(uint64_t until) {
+	unsigned long long wake = atomic_load(&bar_wake);
+	while (until < wake &&
+		!atomic_compare_exchange_weak(&bar_wake, &wake, until));
+}
+
+/* Move the clock over the slots nobody needs before [wake], the first
+ * slot a sleeping device is due back at, and report them at once */
+static void bar_skip_idle(uint64_t wake) {
+	if (atomic_load(&bar_wake) < wake) {
+		wake = atomic_load(&bar_wake);
+	}
+	if (!atomic_load(&bar_busy) && wake != TIMER_NEVER
+			&& wake > _time + 1) {
+		timer_jump(wake);
+	}
+	atomic_store(&bar_busy, 0);
+	atomic_store(&bar_wake, TIMER_NEVER);
+}
+#endif
+
+static void bar_park(int old_sense) {
+#ifdef __linux__
+	syscall(SYS_futex, (int *)&bar_sense, FUTEX_WAIT_PRIVATE,
+		old_sense, NULL, NULL, 0);
+#else
+	(void)old_sense;
+#endif
+}
+
+static void bar_wake_all(void) {
+#ifdef __linux__
+	syscall(SYS_futex, (int *)&bar_sense, FUTEX_WAKE_PRIVATE,
+		INT32_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* First slot a sleeping device is due back at, TIMER_NEVER if none */
+static uint64_t timer_next_wake(void) {
+	struct timer_id_container_t * temp;
+	uint64_t wake = TIMER_NEVER;
+
+	if (atomic_load(&bar_nr_asleep) == 0) {
+		return TIMER_NEVER;
+	}
+	for (temp = dev_list; temp != NULL; temp = temp->next) {
+		uint64_t at = atomic_load(&temp->wake_at);
+		if (at < wake) {
+			wake = at;
 		}
+	}
+	return wake;
+}
+
+/* Number of sleeping devices due back in the current slot. Every
+ * other device has arrived, so nobody can cut a sleep short meanwhile */
+static int timer_nr_due(void) {
+	struct timer_id_container_t * temp;
+	int due = 0;
 
-		/* Increase the time slot */
-		_time++;
-		
-		/* Let devices continue their job */
-		for (temp = dev_list; temp != NULL; temp = temp->next) {
-			pthread_mutex_lock(&temp->id.timer_lock);
-			temp->id.done = 0;
-			pthread_cond_signal(&temp->id.timer_cond);
-			pthread_mutex_unlock(&temp->id.timer_lock);
+	if (atomic_load(&bar_nr_asleep) == 0) {
+		return 0;
+	}
+	for (temp = dev_list; temp != NULL; temp = temp->next) {
+		if (atomic_load(&temp->wake_at) <= _time) {
+			due++;
 		}
-		if (fsh == event) {
-			break;
+	}
+	return due;
+}
+
+/* Bring the sleeping devices due in the current slot back into the
+ * barrier, released with [sense]. The slot counter must already count
+ * them: they may arrive as soon as they are woken up */
+static void timer_wake_due(int sense) {
+	struct timer_id_container_t * temp;
+
+	if (atomic_load(&bar_nr_asleep) == 0) {
+		return;
+	}
+	for (temp = dev_list; temp != NULL; temp = temp->next) {
+		if (atomic_load(&temp->wake_at) > _time) {
+			continue;
 		}
+		pthread_mutex_lock(&temp->park_lock);
+		temp->parked = 0;
+		temp->wake_at = TIMER_NEVER;
+		temp->id.sense = sense;
+		atomic_fetch_sub(&bar_nr_asleep, 1);
+		atomic_fetch_add(&bar_parties, 1);
+		pthread_cond_signal(&temp->park_cond);
+		pthread_mutex_unlock(&temp->park_lock);
 	}
-	pthread_exit(args);
 }
 
-void next_slot(struct timer_id_t * timer_id) {
-	/* Tell to timer that we have done our job in current slot */
-	pthread_mutex_lock(&timer_id->event_lock);
-	timer_id->done = 1;
-	pthread_cond_signal(&timer_id->event_cond);
-	pthread_mutex_unlock(&timer_id->event_lock);
+/* Close the current slot once every device has done its job in it.
+ * Return the number of devices taking part in the next one, counting
+ * the sleeping ones due back in it */
+static int timer_advance(void) {
+	int parties = atomic_load(&bar_parties);
+	uint64_t wake = timer_next_wake();
+
+#ifdef TIMER_SKIP_IDLE
+	if (parties > 0) {
+		bar_skip_idle(wake);
+	}
+#endif
+	if (parties == 0 && wake != TIMER_NEVER && wake > _time + 1) {
+		/* Everybody left is asleep: go straight to the first one due */
+		timer_jump(wake);
+	}
+	/* Increase the time slot */
+	_time++;
+	parties += timer_nr_due();
+	if (parties > 0) {
+		printf("Time slot %3lu\n", current_time());
+	}
+	return parties;
+}
 
-	/* Wait for going to next slot */
-	pthread_mutex_lock(&timer_id->timer_lock);
-	while (timer_id->done) {
-		pthread_cond_wait(
-			&timer_id->timer_cond,
-			&timer_id->timer_lock
-		);
+/* Called by the last device arriving in a slot */
+static void bar_tick(int sense) {
+	int parties = timer_advance();
+
+	/* Let devices continue their job */
+	atomic_store(&bar_count, parties);
+	timer_wake_due(sense);
+	atomic_store(&bar_sense, sense);
+	if (atomic_load(&bar_sleepers) > 0) {
+		bar_wake_all();
+	}
+}
+
+/* Spin for a while then sleep until the slot with [sense] begins */
+static void bar_wait(int sense) {
+	int spin;
+	for (spin = 0; spin < TIMER_SPIN_LIMIT; spin++) {
+		if (atomic_load_explicit(&bar_sense,
+				memory_order_acquire) == sense) {
+			return;
+		}
+	}
+	while (atomic_load(&bar_sense) != sense) {
+		atomic_fetch_add(&bar_sleepers, 1);
+		bar_park(!sense);
+		atomic_fetch_sub(&bar_sleepers, 1);
 	}
-	pthread_mutex_unlock(&timer_id->timer_lock);
+}
+
+/* Arrive at the barrier of the current slot. Return 1 if the caller
+ * was the last device and has already moved the clock forward */
+static int bar_arrive(struct timer_id_t * timer_id) {
+	timer_id->sense = !timer_id->sense;
+	if (atomic_fetch_sub(&bar_count, 1) == 1) {
+		bar_tick(timer_id->sense);
+		return 1;
+	}
+	return 0;
+}
+
+/* Tell to timer that we have done our job in current slot, then
+ * wait for going to next slot */
+static void slot_wait(struct timer_id_t * timer_id) {
+	if (coop) {
+		struct timer_id_container_t * container =
+			(struct timer_id_container_t *)timer_id;
+		swapcontext(&container->ctx, &engine_ctx);
+	}else if (!bar_arrive(timer_id)) {
+		bar_wait(timer_id->sense);
+	}
+}
+
+void next_slot(struct timer_id_t * timer_id) {
+#ifdef TIMER_SKIP_IDLE
+	atomic_store(&bar_busy, 1);
+#endif
+	slot_wait(timer_id);
+}
+
+void idle_slot(struct timer_id_t * timer_id, uint64_t until) {
+#ifdef TIMER_SKIP_IDLE
+	bar_report_idle(until);
+#endif
+	slot_wait(timer_id);
 }
 
 uint64_t current_time() {
@@ -82,14 +270,184 @@ uint64_t current_time() {
 
 void start_timer() {
 	timer_started = 1;
-	pthread_create(&_timer, NULL, timer_routine, NULL);
+#ifdef TIMER_SKIP_IDLE
+	atomic_store(&bar_wake, TIMER_NEVER);
+#endif
+	printf("Time slot %3lu\n", current_time());
 }
 
 void detach_event(struct timer_id_t * event) {
-	pthread_mutex_lock(&event->event_lock);
+	/* Leave the barrier first so the slot we complete (if we are the
+	 * last one) is released with the reduced number of parties */
 	event->fsh = 1;
-	pthread_cond_signal(&event->event_cond);
-	pthread_mutex_unlock(&event->event_lock);
+#ifdef TIMER_SKIP_IDLE
+	atomic_store(&bar_busy, 1);
+#endif
+	atomic_fetch_sub(&bar_parties, 1);
+	if (!coop) {
+		bar_arrive(event);
+	}
+	/* A coroutine goes back to the engine when its routine returns */
+}
+
+/* Leave the barrier, completing the current slot for the others, until
+ * timer_unpark() or, unless [until] is TIMER_NEVER, the slot [until].
+ * Called with the park lock of [container] held, returns without it */
+static void timer_leave(struct timer_id_container_t * container,
+		uint64_t until) {
+	int last;
+
+	container->parked = 1;
+	atomic_store(&container->wake_at, until);
+	if (until != TIMER_NEVER) {
+		atomic_fetch_add(&bar_nr_asleep, 1);
+	}
+	atomic_fetch_sub(&bar_parties, 1);
+	if (coop) {
+		/* The engine skips us until we are woken up */
+		pthread_mutex_unlock(&container->park_lock);
+		while (container->parked) {
+			swapcontext(&container->ctx, &engine_ctx);
+		}
+		return;
+	}
+	/* Arrive, but close the slot only once the lock is released: the
+	 * tick may be the one that wakes us up */
+	container->id.sense = !container->id.sense;
+	last = atomic_fetch_sub(&bar_count, 1) == 1;
+	pthread_mutex_unlock(&container->park_lock);
+	if (last) {
+		bar_tick(container->id.sense);
+	}
+	pthread_mutex_lock(&container->park_lock);
+	while (container->parked) {
+		pthread_cond_wait(&container->park_cond, &container->park_lock);
+	}
+	pthread_mutex_unlock(&container->park_lock);
+	/* Woken up by a tick: wait until it has released the new slot */
+	bar_wait(container->id.sense);
+}
+
+/* A wake-up only matters within the slot it was sent in: once the device
+ * has parked or ended its batch it looks at its work again anyway, so a
+ * late one must not cut its next batch short */
+static void wake_drop(struct timer_id_container_t * container) {
+	pthread_mutex_lock(&container->park_lock);
+	container->wake_pending = 0;
+	pthread_mutex_unlock(&container->park_lock);
+}
+
+void timer_park(struct timer_id_t * timer_id) {
+	struct timer_id_container_t * container =
+		(struct timer_id_container_t *)timer_id;
+
+	pthread_mutex_lock(&container->park_lock);
+	if (container->wake_pending) {
+		container->wake_pending = 0;
+		pthread_mutex_unlock(&container->park_lock);
+		return;
+	}
+#ifdef TIMER_SKIP_IDLE
+	bar_report_idle(TIMER_NEVER);
+#endif
+	timer_leave(container, TIMER_NEVER);
+	wake_drop(container);
+}
+
+uint64_t next_slots(struct timer_id_t * timer_id, uint64_t n) {
+	struct timer_id_container_t * container =
+		(struct timer_id_container_t *)timer_id;
+	uint64_t start = current_time();
+
+	if (n == 0) {
+		return 0;
+	}
+	if (n == 1) {
+		next_slot(timer_id);
+		wake_drop(container);
+		return 1;
+	}
+	pthread_mutex_lock(&container->park_lock);
+	if (container->wake_pending) {
+		container->wake_pending = 0;
+		pthread_mutex_unlock(&container->park_lock);
+		return 0;
+	}
+#ifdef TIMER_SKIP_IDLE
+	atomic_store(&bar_busy, 1);
+#endif
+	timer_leave(container, start + n);
+	wake_drop(container);
+	return current_time() - start;
+}
+
+void timer_unpark(struct timer_id_t * timer_id) {
+	struct timer_id_container_t * container =
+		(struct timer_id_container_t *)timer_id;
+
+	pthread_mutex_lock(&container->park_lock);
+	if (container->parked) {
+		/* Join the slot the caller is in: it has not arrived yet, so
+		 * the slot cannot close before the woken device arrives too */
+		container->parked = 0;
+		if (container->wake_at != TIMER_NEVER) {
+			/* Cut a sleep short */
+			container->wake_at = TIMER_NEVER;
+			atomic_fetch_sub(&bar_nr_asleep, 1);
+		}
+		timer_id->sense = atomic_load(&bar_sense);
+		atomic_fetch_add(&bar_parties, 1);
+		if (!coop) {
+			atomic_fetch_add(&bar_count, 1);
+		}
+		pthread_cond_signal(&container->park_cond);
+	}else{
+		container->wake_pending = 1;
+	}
+	pthread_mutex_unlock(&container->park_lock);
+}
+
+static void co_entry(void) {
+	co_current->routine(co_current->arg);
+}
+
+void timer_coop_spawn(struct timer_id_t * timer_id,
+		void * (*routine)(void *), void * arg) {
+	struct timer_id_container_t * container =
+		(struct timer_id_container_t *)timer_id;
+	coop = 1;
+	container->routine = routine;
+	container->arg = arg;
+	container->stack = malloc(TIMER_CO_STACKSZ);
+	getcontext(&container->ctx);
+	container->ctx.uc_stack.ss_sp = container->stack;
+	container->ctx.uc_stack.ss_size = TIMER_CO_STACKSZ;
+	container->ctx.uc_link = &engine_ctx;
+	makecontext(&container->ctx, co_entry, 0);
+	container->co_next = NULL;
+	if (co_tail == NULL) {
+		co_head = container;
+	}else{
+		co_tail->co_next = container;
+	}
+	co_tail = container;
+}
+
+void timer_coop_run(void) {
+	struct timer_id_container_t * temp;
+	while (atomic_load(&bar_parties) > 0 ||
+			atomic_load(&bar_nr_asleep) > 0) {
+		/* Step every device through the current slot */
+		for (temp = co_head; temp != NULL; temp = temp->co_next) {
+			if (temp->id.fsh || temp->parked) {
+				continue;
+			}
+			co_current = temp;
+			swapcontext(&engine_ctx, &temp->ctx);
+		}
+		timer_advance();
+		timer_wake_due(0);
+	}
 }
 
 struct timer_id_t * attach_event() {
@@ -100,12 +458,16 @@ struct timer_id_t * attach_event() {
 			(struct timer_id_container_t*)malloc(
 				sizeof(struct timer_id_container_t)		
 			);
-		container->id.done = 0;
 		container->id.fsh = 0;
-		pthread_cond_init(&container->id.event_cond, NULL);
-		pthread_mutex_init(&container->id.event_lock, NULL);
-		pthread_cond_init(&container->id.timer_cond, NULL);
-		pthread_mutex_init(&container->id.timer_lock, NULL);
+		container->stack = NULL;
+		container->parked = 0;
+		container->wake_pending = 0;
+		container->wake_at = TIMER_NEVER;
+		pthread_mutex_init(&container->park_lock, NULL);
+		pthread_cond_init(&container->park_cond, NULL);
+		container->id.sense = atomic_load(&bar_sense);
+		atomic_fetch_add(&bar_parties, 1);
+		atomic_fetch_add(&bar_count, 1);
 		if (dev_list == NULL) {
 			dev_list = container;
 			dev_list->next = NULL;
@@ -118,19 +480,14 @@ struct timer_id_t * attach_event() {
 }
 
 void stop_timer() {
-	timer_stop = 1;
-	pthread_join(_timer, NULL);
+	/* Every device has detached by now, the barrier is idle */
 	while (dev_list != NULL) {
 		struct timer_id_container_t * temp = dev_list;
 		dev_list = dev_list->next;
-		pthread_cond_destroy(&temp->id.event_cond);
-		pthread_mutex_destroy(&temp->id.event_lock);
-		pthread_cond_destroy(&temp->id.timer_cond);
-		pthread_mutex_destroy(&temp->id.timer_lock);
+		pthread_mutex_destroy(&temp->park_lock);
+		pthread_cond_destroy(&temp->park_cond);
+		free(temp->stack);
 		free(temp);
 	}
 }
 
-
-
-